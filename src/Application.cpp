@@ -6,6 +6,7 @@
 #include "data/Resource.h"
 
 #include "mapview/MapView.h"
+#include "maplogic/MapBenchmarks.h"
 
 Application* Application::mApplication = nullptr;
 std::vector<std::string> Application::mArguments;
@@ -70,7 +71,16 @@ void Application::Abort(std::string message)
 
 uint64_t Application::GetTicks()
 {
-	return uint64_t(SDL_GetTicks());
+	return GetMicroTicks() / 1000;
+}
+
+uint64_t Application::GetMicroTicks()
+{
+	static const uint64_t frequency = SDL_GetPerformanceFrequency();
+	static const uint64_t start = SDL_GetPerformanceCounter();
+	uint64_t counter = SDL_GetPerformanceCounter() - start;
+	// split to avoid overflowing counter * 1000000
+	return (counter / frequency) * 1000000 + (counter % frequency) * 1000000 / frequency;
 }
 
 int Application::Run()
@@ -93,6 +103,15 @@ int Application::Run()
 	DrawingContext ctx(mScreen);
 	ctx.ClearRect(ctx.GetViewport(), Color(0, 0, 0, 255));
 
+	// -fps N sets the frame rate cap, 0 = uncapped
+	uint32_t targetRate = 60;
+	for (size_t i = 1; i + 1 < mArguments.size(); i++)
+	{
+		if (mArguments[i] == "-fps")
+			targetRate = uint32_t(atoi(mArguments[i + 1].c_str()));
+	}
+	mScheduler.SetTargetRate(targetRate);
+
 	// start loading data.bin & reg files
 	mTemplateLoader = new TemplateLoader(mUIRoot);
 
@@ -116,10 +135,9 @@ int Application::Run()
 
 		mMouse->PreApply();
 		mScreen->Apply();
-		mMouse->PostApply();
 
-		if (mScreen->GetFPS() > 60)
-			SDL_Delay(1);
+		// wait here, right before the next event poll, so input is as fresh as possible
+		mScheduler.EndFrame();
 	}
 	
 	return 0;
@@ -135,6 +153,29 @@ void Application::HandleEvent(const SDL_Event* ev)
 	case SDL_MOUSEMOTION:
 		mMouse->SetPosition(Point(ev->motion.x, ev->motion.y));
 		break;
+	case SDL_KEYDOWN:
+#ifdef ALLODS_BENCHMARKS
+		// shows what is presented every frame
+		if (ev->key.keysym.sym == SDLK_F2)
+			mScreen->SetDamageOverlay(!mScreen->IsDamageOverlay());
+		// frame statistics
+		if (ev->key.keysym.sym == SDLK_F3)
+			mScheduler.SetReporting(!mScheduler.IsReporting());
+		// cycle frame rate cap
+		if (ev->key.keysym.sym == SDLK_F4)
+		{
+			static const uint32_t rates[] = { 30, 60, 120, 144, 0 };
+			size_t next = 0;
+			for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+			{
+				if (rates[i] == mScheduler.GetTargetRate())
+					next = (i + 1) % (sizeof(rates) / sizeof(rates[0]));
+			}
+			mScheduler.SetTargetRate(rates[next]);
+			Printf("frame rate cap: %u", rates[next]);
+		}
+#endif
+		break;
 	default:
 		break;
 	}
@@ -8,6 +8,7 @@
 #include "ui/RootUIElement.h"
 #include "maplogic/MapLogic.h"
 #include "templates/TemplateLoader.h"
+#include "FrameScheduler.h"
 
 class Application
 {
@@ -23,6 +24,8 @@ public:
 	void Abort(std::string message);
 
 	static uint64_t GetTicks();
+	// high resolution time from the performance counter
+	static uint64_t GetMicroTicks();
 
 	//
 	ResourceManager* GetResources();
@@ -39,6 +42,7 @@ private:
 
 	Screen* mScreen;
 	bool mExiting = false;
+	FrameScheduler mScheduler;
 
 	//
 	void HandleEvent(const SDL_Event* ev);
@@ -0,0 +1,86 @@
+#include "FrameScheduler.h"
+#include "Application.h"
+#include "logging.h"
+#include <SDL.h>
+
+const uint64_t FrameScheduler::SpinMicroseconds;
+
+FrameScheduler::FrameScheduler()
+{
+	mFrameStart = Application::GetMicroTicks();
+	mStatsStart = mFrameStart;
+}
+
+void FrameScheduler::SetTargetRate(uint32_t fps)
+{
+	mTargetRate = fps;
+	mFrameLength = fps ? 1000000 / fps : 0;
+	mDeadline = Application::GetMicroTicks() + mFrameLength;
+}
+
+void FrameScheduler::EndFrame()
+{
+	uint64_t now = Application::GetMicroTicks();
+	uint64_t work = now - mFrameStart;
+	mStatsWork += work;
+	if (work > mStatsWorkMax)
+		mStatsWorkMax = work;
+	mStatsFrames++;
+
+	if (mFrameLength)
+	{
+		if (now < mDeadline)
+		{
+			// coarse sleep, leaving the last bit to the spin
+			uint64_t left = mDeadline - now;
+			if (left > SpinMicroseconds)
+			{
+				SDL_Delay(uint32_t((left - SpinMicroseconds) / 1000));
+				uint64_t slept = Application::GetMicroTicks();
+				mStatsSleep += slept - now;
+				now = slept;
+			}
+
+			uint64_t spinStart = now;
+			while (now < mDeadline)
+				now = Application::GetMicroTicks();
+			mStatsSpin += now - spinStart;
+
+			mDeadline += mFrameLength;
+		}
+		else
+		{
+			mStatsLate++;
+			// deadlines advance by whole frames so the rate does not drift, but after a hitch
+			// start over from now instead of rushing frames to catch up
+			mDeadline += mFrameLength;
+			if (mDeadline <= now)
+				mDeadline = now + mFrameLength;
+		}
+	}
+
+	mFrameStart = now;
+	if (now - mStatsStart >= 1000000)
+		Report(now);
+}
+
+void FrameScheduler::Report(uint64_t now)
+{
+	if (mReporting && mStatsFrames)
+	{
+		double seconds = double(now - mStatsStart) / 1000000.0;
+		Printf("frames: %u in %.3f s (target %u), work avg %.3f ms max %.3f ms, sleep avg %.3f ms, spin avg %.3f ms, late %u",
+			mStatsFrames, seconds, mTargetRate,
+			double(mStatsWork) / mStatsFrames / 1000.0, double(mStatsWorkMax) / 1000.0,
+			double(mStatsSleep) / mStatsFrames / 1000.0, double(mStatsSpin) / mStatsFrames / 1000.0,
+			mStatsLate);
+	}
+
+	mStatsStart = now;
+	mStatsFrames = 0;
+	mStatsLate = 0;
+	mStatsWork = 0;
+	mStatsWorkMax = 0;
+	mStatsSleep = 0;
+	mStatsSpin = 0;
+}
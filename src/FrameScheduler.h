@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+// paces the main loop to a target frame rate.
+// waits with SDL_Delay until shortly before the deadline, then spins on the performance counter,
+// because SDL_Delay alone overshoots by up to a scheduler quantum.
+class FrameScheduler
+{
+public:
+	// time before the deadline that is spun instead of slept
+	static const uint64_t SpinMicroseconds = 2000;
+
+	FrameScheduler();
+
+	// 0 = uncapped
+	void SetTargetRate(uint32_t fps);
+	uint32_t GetTargetRate() { return mTargetRate; }
+
+	// call once per frame, after presenting. sleeps until the next frame is due
+	void EndFrame();
+
+	// print a line of frame statistics every second
+	void SetReporting(bool enabled) { mReporting = enabled; }
+	bool IsReporting() { return mReporting; }
+
+private:
+	uint32_t mTargetRate = 0;
+	uint64_t mFrameLength = 0;
+	uint64_t mDeadline = 0;
+	uint64_t mFrameStart = 0;
+	bool mReporting = false;
+
+	// stats for the current report interval, in microseconds
+	uint64_t mStatsStart = 0;
+	uint32_t mStatsFrames = 0;
+	uint32_t mStatsLate = 0;
+	uint64_t mStatsWork = 0;
+	uint64_t mStatsWorkMax = 0;
+	uint64_t mStatsSleep = 0;
+	uint64_t mStatsSpin = 0;
+
+	void Report(uint64_t now);
+};
@@ -66,4 +66,108 @@ void RLock::Unlock()
 	SDL_mutex* uMutex = mMutex;
 	mMutex = nullptr;
 	SDL_UnlockMutex(uMutex);
+}
+
+/////////
+
+Semaphore::Semaphore(uint32_t value)
+{
+	mSemaphore = SDL_CreateSemaphore(value);
+}
+
+Semaphore::~Semaphore()
+{
+	if (mSemaphore != nullptr)
+		SDL_DestroySemaphore(mSemaphore);
+	mSemaphore = nullptr;
+}
+
+void Semaphore::Post()
+{
+	SDL_SemPost(mSemaphore);
+}
+
+void Semaphore::Wait()
+{
+	SDL_SemWait(mSemaphore);
+}
+
+bool Semaphore::WaitTimeout(uint32_t ms)
+{
+	return SDL_SemWaitTimeout(mSemaphore, ms) == 0;
+}
+
+/////////
+
+WorkerPool::WorkerPool(uint32_t numThreads)
+{
+	if (numThreads == 0)
+		numThreads = SDL_GetCPUCount();
+	// calling thread is one of the workers
+	for (uint32_t i = 1; i < numThreads; i++)
+	{
+		Worker* worker = new Worker(this);
+		mWorkers.push_back(worker);
+		worker->Start();
+	}
+	SDL_AtomicSet(&mNextJob, 0);
+}
+
+WorkerPool::~WorkerPool()
+{
+	mExiting = true;
+	for (size_t i = 0; i < mWorkers.size(); i++)
+		mStart.Post();
+	for (auto& worker : mWorkers)
+	{
+		worker->Wait();
+		delete worker;
+	}
+}
+
+WorkerPool* WorkerPool::GetDefault()
+{
+	// never destroyed, threads just stay parked until exit
+	static WorkerPool* pool = new WorkerPool();
+	return pool;
+}
+
+uint32_t WorkerPool::GetConcurrency()
+{
+	return mWorkers.size() + 1;
+}
+
+void WorkerPool::Run(uint32_t count, const std::function<void(uint32_t)>& job)
+{
+	if (count == 0)
+		return;
+
+	if (mWorkers.empty() || count == 1)
+	{
+		for (uint32_t i = 0; i < count; i++)
+			job(i);
+		return;
+	}
+
+	RLock lock(mRunMutex);
+	mJob = &job;
+	mJobCount = count;
+	SDL_AtomicSet(&mNextJob, 0);
+	for (size_t i = 0; i < mWorkers.size(); i++)
+		mStart.Post();
+	DoJobs();
+	for (size_t i = 0; i < mWorkers.size(); i++)
+		mDone.Wait();
+	mJob = nullptr;
+}
+
+void WorkerPool::DoJobs()
+{
+	while (true)
+	{
+		uint32_t index = SDL_AtomicAdd(&mNextJob, 1);
+		if (index >= mJobCount)
+			break;
+		(*mJob)(index);
+	}
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <SDL.h>
 #include <string>
+#include <vector>
+#include <functional>
 
 class Thread
 {
@@ -44,4 +46,72 @@ public:
 private:
 	SDL_mutex* mMutex;
 	friend class Mutex;
+};
+
+class Semaphore
+{
+public:
+	explicit Semaphore(uint32_t value = 0);
+	virtual ~Semaphore();
+
+	void Post();
+	void Wait();
+	// false if the time ran out
+	bool WaitTimeout(uint32_t ms);
+
+private:
+	SDL_sem* mSemaphore;
+};
+
+// runs jobs on persistent worker threads
+class WorkerPool
+{
+public:
+	// 0 means one thread per CPU core
+	explicit WorkerPool(uint32_t numThreads = 0);
+	virtual ~WorkerPool();
+
+	// calls job(i) for every i in [0, count), calling thread takes jobs as well. returns when all jobs are done
+	void Run(uint32_t count, const std::function<void(uint32_t)>& job);
+	// number of threads that take jobs, including the calling one
+	uint32_t GetConcurrency();
+
+	static WorkerPool* GetDefault();
+
+private:
+	class Worker : public Thread
+	{
+		WorkerPool* mPool;
+
+	public:
+		Worker(WorkerPool* pool) : Thread("Worker")
+		{
+			mPool = pool;
+		}
+
+		virtual int Run()
+		{
+			while (true)
+			{
+				mPool->mStart.Wait();
+				if (mPool->mExiting)
+					break;
+				mPool->DoJobs();
+				mPool->mDone.Post();
+			}
+			return 0;
+		}
+	};
+
+	void DoJobs();
+
+	std::vector<Worker*> mWorkers;
+	Semaphore mStart;
+	Semaphore mDone;
+	Mutex mRunMutex;
+	bool mExiting = false;
+
+	const std::function<void(uint32_t)>* mJob = nullptr;
+	uint32_t mJobCount = 0;
+	SDL_atomic_t mNextJob;
 };
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include "ImageIndexed.h"
+
+ImageIndexed::ImageIndexed(uint32_t w, uint32_t h)
+{
+	SetSize(w, h);
+}
+
+uint32_t ImageIndexed::GetWidth()
+{
+	return mWidth;
+}
+
+uint32_t ImageIndexed::GetHeight()
+{
+	return mHeight;
+}
+
+void ImageIndexed::DrawPartial(DrawingContext& ctx, int32_t x, int32_t y, const Rect& innerRect, int32_t colorkey)
+{
+
+	if (mLookup == nullptr)
+		return;
+
+	// first, take rect in screen space and clip it to viewport
+	Rect viewRec = ctx.GetViewport();
+	Rect screenRec = Rect::FromXYWH(x, y, innerRect.w, innerRect.h).GetIntersection(viewRec);
+	if (screenRec.w > mWidth) screenRec.w = mWidth;
+	if (screenRec.h > mHeight) screenRec.h = mHeight;
+	Rect clipRec = Rect::FromXYWH(screenRec.x - x + innerRect.x, screenRec.y - y + innerRect.y, screenRec.w, screenRec.h).GetIntersection(Rect::FromXYWH(0, 0, mWidth, mHeight));
+
+	Color* screenBuffer = ctx.GetBuffer() + screenRec.y * ctx.GetPitch() + screenRec.x;
+	uint16_t* buffer = mPixels.data() + clipRec.y * mWidth + clipRec.x;
+
+	if (colorkey < 0)
+	{
+		for (int y = clipRec.GetTop(); y < clipRec.GetBottom(); y++)
+		{
+			// resolve is a single table read per pixel
+			int x = 0;
+			for (; x + 4 <= clipRec.w; x += 4)
+			{
+				screenBuffer[0] = mLookup[buffer[0]];
+				screenBuffer[1] = mLookup[buffer[1]];
+				screenBuffer[2] = mLookup[buffer[2]];
+				screenBuffer[3] = mLookup[buffer[3]];
+				screenBuffer += 4;
+				buffer += 4;
+			}
+			for (; x < clipRec.w; x++)
+				*screenBuffer++ = mLookup[*buffer++];
+			screenBuffer += ctx.GetPitch() - clipRec.w;
+			buffer += mWidth - clipRec.w;
+		}
+	}
+	else
+	{
+		for (int y = clipRec.GetTop(); y < clipRec.GetBottom(); y++)
+		{
+			for (int x = clipRec.GetLeft(); x < clipRec.GetRight(); x++)
+			{
+				Color c = mLookup[*buffer];
+				if ((c.value & 0xF0F0F0) != (colorkey & 0xF0F0F0))
+					*screenBuffer = c;
+				buffer++;
+				screenBuffer++;
+			}
+			screenBuffer += ctx.GetPitch() - clipRec.w;
+			buffer += mWidth - clipRec.w;
+		}
+	}
+
+}
+
+void ImageIndexed::BlitPartial(DrawingContext& ctx, int32_t x, int32_t y, const Rect& innerRect)
+{
+	DrawPartial(ctx, x, y, innerRect, -1);
+}
+
+uint16_t* ImageIndexed::GetBuffer()
+{
+	return mPixels.data();
+}
+
+void ImageIndexed::SetLookup(const Color* lookup)
+{
+	mLookup = lookup;
+}
+
+void ImageIndexed::SetSize(uint32_t w, uint32_t h)
+{
+	mWidth = w;
+	mHeight = h;
+	mPixels.resize(w * h);
+}
+
+void ImageIndexed::MoveInPlace(int32_t offsX, int32_t offsY)
+{
+	if (offsX == 0 && offsY == 0)
+		return;
+
+	if (offsX + int32_t(mWidth) <= 0 || offsY + int32_t(mHeight) <= 0 || offsX > int32_t(mWidth) || offsY > int32_t(mHeight))
+		return;
+
+	uint16_t* buffer = mPixels.data();
+	bool isBackwards = int32_t(mWidth) * offsY + offsX >= 0;
+	Rect copyRect = Rect::FromXYWH(offsX, offsY, mWidth, mHeight).GetIntersection(Rect::FromXYWH(0, 0, mWidth, mHeight));
+
+	if (!isBackwards)
+	{
+		uint16_t* copyTo = buffer + copyRect.y * mWidth + copyRect.x;
+		buffer = buffer + (copyRect.y - offsY) * mWidth + (copyRect.x - offsX);
+		for (int y = copyRect.GetTop(); y < copyRect.GetBottom(); y++)
+		{
+			for (int x = copyRect.GetLeft(); x < copyRect.GetRight(); x++)
+				*copyTo++ = *buffer++;
+			copyTo += mWidth - copyRect.w;
+			buffer += mWidth - copyRect.w;
+		}
+	}
+	else
+	{
+		uint16_t* copyTo = buffer + mWidth * mHeight - (copyRect.y - offsY) * mWidth - (copyRect.x - offsX) - 1;
+		buffer = buffer + mWidth * mHeight - copyRect.y * mWidth - copyRect.x - 1;
+		for (int y = copyRect.GetBottom() - 1; y >= copyRect.GetTop(); y--)
+		{
+			for (int x = copyRect.GetRight() - 1; x >= copyRect.GetLeft(); x--)
+				*copyTo-- = *buffer--;
+			copyTo -= mWidth - copyRect.w;
+			buffer -= mWidth - copyRect.w;
+		}
+	}
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Image.h"
+#include <vector>
+#include "../screen/Color.h"
+
+// image with 16-bit indices into an external lookup table. lookup table can be changed without touching pixels
+class ImageIndexed : public Image
+{
+public:
+	ImageIndexed(uint32_t w, uint32_t h);
+
+	virtual uint32_t GetWidth();
+	virtual uint32_t GetHeight();
+
+	virtual void Draw(DrawingContext& ctx, int32_t x, int32_t y, int32_t colorkey = IMAGE_NO_COLORKEY) { DrawPartial(ctx, x, y, Rect::FromXYWH(0, 0, mWidth, mHeight), colorkey); }
+	virtual void DrawPartial(DrawingContext& ctx, int32_t x, int32_t y, const Rect& innerRect, int32_t colorkey = IMAGE_NO_COLORKEY);
+	virtual void Blit(DrawingContext& ctx, int32_t x, int32_t y) { BlitPartial(ctx, x, y, Rect::FromXYWH(0, 0, mWidth, mHeight)); }
+	virtual void BlitPartial(DrawingContext& ctx, int32_t x, int32_t y, const Rect& innerRect);
+
+	uint16_t* GetBuffer();
+	// lookup table must have 65536 entries. it's not copied
+	void SetLookup(const Color* lookup);
+
+	void SetSize(uint32_t w, uint32_t h);
+	void MoveInPlace(int32_t offsX, int32_t offsY);
+
+private:
+	uint32_t mWidth;
+	uint32_t mHeight;
+	std::vector<uint16_t> mPixels;
+	const Color* mLookup = nullptr;
+};
@@ -2,6 +2,7 @@
 #include "../Application.h"
 #include "../utils.h"
 #include "../logging.h"
+#include <algorithm>
 
 Sprite256::Sprite256(const std::string& path)
 {
@@ -115,7 +116,7 @@ void Sprite256::Draw(DrawingContext& ctx, int32_t x, int32_t y, uint32_t index,
 
 }
 
-void Sprite256::DrawShadow(DrawingContext& ctx, int32_t x, int32_t y, uint32_t index, int32_t offset, uint8_t power)
+void Sprite256::DrawCells(DrawingContext& ctx, int32_t x, int32_t y, uint32_t index, const CellPalettes& palettes)
 {
 
 	if (index >= mFrames.size())
@@ -125,21 +126,93 @@ void Sprite256::DrawShadow(DrawingContext& ctx, int32_t x, int32_t y, uint32_t i
 	uint8_t* spriteData = (uint8_t*)frame.mData.data();
 
 	Rect frameRec = Rect::FromXYWH(x, y, frame.mWidth, frame.mHeight);
-	if (offset < 0)
-		frameRec.SetLeft(frameRec.GetLeft() - offset);
-	if (offset > 0)
-		frameRec.SetRight(frameRec.GetRight() + offset);
 	Rect viewRec = ctx.GetViewport();
 	if (!viewRec.Intersects(frameRec))
 		return;
 
-	bool isWhole = (viewRec.GetIntersection(frameRec) == frameRec);
+	Color* buffer = ctx.GetBuffer() + ctx.GetPitch() * y + x;
+
+	int32_t inX = x;
+	int32_t inY = y;
+	uint8_t* maxSpriteData = (uint8_t*)(frame.mData.data() + frame.mData.size());
+	while (spriteData < maxSpriteData)
+	{
+		uint8_t rleType = *spriteData++;
+
+		if (rleType & 0xC0)
+		{
+			if (rleType & 0x40)
+			{
+				buffer += ctx.GetPitch() * (rleType & 0x3F);
+				inY += rleType & 0x3F;
+			}
+			else
+			{
+				buffer += rleType & 0x3F;
+				inX += rleType & 0x3F;
+				if (inX >= static_cast<int32_t>(frame.mWidth) + x)
+				{
+					inX = x + (inX - (frame.mWidth + x));
+					inY++;
+					buffer += ctx.GetPitch() - frame.mWidth;
+				}
+			}
+		}
+		else
+		{
+			rleType &= 0x3F;
+
+			if (inY < viewRec.GetTop() || inY >= viewRec.GetBottom())
+			{
+				spriteData += rleType;
+				buffer += rleType;
+				inX += rleType;
+				continue;
+			}
+
+			// some pixels
+			for (uint8_t i = 0; i < rleType; i++)
+			{
+				if (inX >= viewRec.GetLeft() && inX < viewRec.GetRight())
+				{
+					uint8_t palIndex = *spriteData;
+					int32_t cellX = std::max(0, std::min(palettes.mPitch - 1, (inX - palettes.mOffsetX) >> 5));
+					int32_t cellY = std::max(0, std::min(palettes.mRows - 1, (inY - palettes.mOffsetY) >> 5));
+					uint8_t cell = palettes.mCells[cellY * palettes.mPitch + cellX];
+					*buffer = Color(palettes.mPalettes[cell][palIndex], 255);
+				}
+
+				spriteData++;
+				buffer++;
+				inX++;
+			}
+		}
+	}
+
+}
+
+Rect Sprite256::DrawShadowMask(uint8_t* mask, int32_t maskPitch, const Rect& maskRect, int32_t x, int32_t y, uint32_t index, int32_t offset, uint8_t value)
+{
+
+	if (index >= mFrames.size())
+		return Rect();
+
+	SpriteFrame& frame = mFrames[index];
+	uint8_t* spriteData = (uint8_t*)frame.mData.data();
+
+	// skewed shadow spans [x + min(offset, 0), x + w + max(offset, 0))
+	Rect frameRec = Rect::FromXYWH(x, y, frame.mWidth, frame.mHeight);
+	if (offset < 0)
+		frameRec.SetLeft(frameRec.GetLeft() + offset);
+	if (offset > 0)
+		frameRec.SetRight(frameRec.GetRight() + offset);
+	Rect touched = maskRect.GetIntersection(frameRec);
+	if (touched.w <= 0 || touched.h <= 0)
+		return Rect();
 
 	float offs = offset;
 	float yDelta = offs / frame.mHeight;
 
-	Color* buffer = ctx.GetBuffer() + ctx.GetPitch() * y + x + int32_t(offs);
-
 	int32_t inX = x + int32_t(offs);
 	int32_t inY = y;
 	uint8_t* maxSpriteData = (uint8_t*)(frame.mData.data() + frame.mData.size());
@@ -155,12 +228,10 @@ void Sprite256::DrawShadow(DrawingContext& ctx, int32_t x, int32_t y, uint32_t i
 				inY += rleType & 0x3F;
 				offs -= yDelta * (rleType & 0x3F);
 				inX = x + offs;
-				buffer = ctx.GetBuffer() + ctx.GetPitch() * inY + inX;
 				nextOffs = inX + frame.mWidth;
 			}
 			else
 			{
-				buffer += rleType & 0x3F;
 				inX += rleType & 0x3F;
 				if (inX >= nextOffs)
 				{
@@ -170,7 +241,6 @@ void Sprite256::DrawShadow(DrawingContext& ctx, int32_t x, int32_t y, uint32_t i
 					inX = x + offs;
 					nextOffs = inX + frame.mWidth;
 					inX += fallthroughRLEOffset;
-					buffer = ctx.GetBuffer() + ctx.GetPitch() * inY + inX;
 				}
 			}
 		}
@@ -178,30 +248,81 @@ void Sprite256::DrawShadow(DrawingContext& ctx, int32_t x, int32_t y, uint32_t i
 		{
 			rleType &= 0x3F;
 
-			if (inY < viewRec.GetTop() || inY >= viewRec.GetBottom())
+			if (inY < touched.GetTop() || inY >= touched.GetBottom())
 			{
 				spriteData += rleType;
-				buffer += rleType;
 				inX += rleType;
 				continue;
 			}
 
-			// some pixels
+			// some pixels. overlapping shadows keep the darkest value instead of compounding
+			uint8_t* row = mask + (inY - maskRect.y) * maskPitch;
 			for (uint8_t i = 0; i < rleType; i++)
 			{
-				if (inX >= viewRec.GetLeft() && inX < viewRec.GetRight())
-				{
-					uint8_t palIndex = *spriteData;
-					buffer->components.r /= power;
-					buffer->components.g /= power;
-					buffer->components.b /= power;
-				}
+				if (inX >= touched.GetLeft() && inX < touched.GetRight() && row[inX - maskRect.x] < value)
+					row[inX - maskRect.x] = value;
 
 				spriteData++;
-				buffer++;
 				inX++;
 			}
 		}
 	}
 
+	return touched;
+
+}
+void Sprite256::ClearMask(uint8_t* mask, int32_t maskPitch, const Rect& maskRect, int32_t x, int32_t y, uint32_t index)
+{
+
+	if (index >= mFrames.size())
+		return;
+
+	SpriteFrame& frame = mFrames[index];
+	uint8_t* spriteData = (uint8_t*)frame.mData.data();
+
+	Rect frameRec = Rect::FromXYWH(x, y, frame.mWidth, frame.mHeight);
+	Rect touched = maskRect.GetIntersection(frameRec);
+	if (touched.w <= 0 || touched.h <= 0)
+		return;
+
+	int32_t inX = x;
+	int32_t inY = y;
+	uint8_t* maxSpriteData = (uint8_t*)(frame.mData.data() + frame.mData.size());
+	while (spriteData < maxSpriteData)
+	{
+		uint8_t rleType = *spriteData++;
+
+		if (rleType & 0xC0)
+		{
+			if (rleType & 0x40)
+				inY += rleType & 0x3F;
+			else
+			{
+				inX += rleType & 0x3F;
+				if (inX >= static_cast<int32_t>(frame.mWidth) + x)
+				{
+					inX = x + (inX - (frame.mWidth + x));
+					inY++;
+				}
+			}
+		}
+		else
+		{
+			rleType &= 0x3F;
+
+			if (inY >= touched.GetTop() && inY < touched.GetBottom())
+			{
+				// same pixels as Draw writes
+				int32_t spanLeft = std::max(inX, touched.GetLeft());
+				int32_t spanRight = std::min(inX + int32_t(rleType), touched.GetRight());
+				uint8_t* row = mask + (inY - maskRect.y) * maskPitch - maskRect.x;
+				if (spanLeft < spanRight)
+					std::fill(row + spanLeft, row + spanRight, 0);
+			}
+
+			spriteData += rleType;
+			inX += rleType;
+		}
+	}
+
 }
\ No newline at end of file
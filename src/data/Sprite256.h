@@ -3,13 +3,31 @@
 #include <string>
 #include "Sprite.h"
 
+// palette is selected per 32x32 screen cell. used to draw sprites with fog of war fused into palettes
+struct CellPalettes
+{
+	const uint8_t* mCells;
+	// cells outside of mPitch x mRows use the nearest edge cell
+	int32_t mPitch;
+	int32_t mRows;
+	// screen position of cell (0, 0)
+	int32_t mOffsetX;
+	int32_t mOffsetY;
+	const Color* mPalettes[4];
+};
+
 class Sprite256 : public Sprite
 {
 public:
 
 	Sprite256(const std::string& path);
 	virtual void Draw(DrawingContext& ctx, int32_t x, int32_t y, uint32_t index, const Color* palette);
-	// shadow power = rgb / power
-	void DrawShadow(DrawingContext& ctx, int32_t x, int32_t y, uint32_t index, int32_t offset, uint8_t power);
+	// same as Draw, but palette is looked up for every pixel from cell
+	void DrawCells(DrawingContext& ctx, int32_t x, int32_t y, uint32_t index, const CellPalettes& palettes);
+	// rasterizes the shadow of the frame, skewed by offset towards the bottom, into an 8-bit coverage mask
+	// (mask origin is at maskRect top-left), keeping max(mask, value). returns the rect that may have been touched
+	Rect DrawShadowMask(uint8_t* mask, int32_t maskPitch, const Rect& maskRect, int32_t x, int32_t y, uint32_t index, int32_t offset, uint8_t value);
+	// zeroes the coverage mask under every opaque pixel of the frame: a sprite drawn over a pending shadow hides it
+	void ClearMask(uint8_t* mask, int32_t maskPitch, const Rect& maskRect, int32_t x, int32_t y, uint32_t index);
 
 };
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+
+// SSE2 is available on every x86/x64 target we build for. other platforms use scalar code paths
+#if defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define ALLODS_SSE2 1
+#include <emmintrin.h>
+#endif
@@ -0,0 +1,92 @@
+#include "DirtyNodeSet.h"
+#include <algorithm>
+
+void DirtyNodeSet::SetSize(uint32_t w, uint32_t h)
+{
+	mWidth = w;
+	mHeight = h;
+	mChunksWidth = (w + (1 << ChunkShift) - 1) >> ChunkShift;
+	uint32_t chunksHeight = (h + (1 << ChunkShift) - 1) >> ChunkShift;
+	mBits.assign((w * h + 63) / 64, 0);
+	mChunkBits.assign((mChunksWidth * chunksHeight + 63) / 64, 0);
+	mQueue.clear();
+}
+
+void DirtyNodeSet::Mark(uint32_t x, uint32_t y)
+{
+	if (x >= mWidth || y >= mHeight)
+		return;
+
+	uint32_t index = y * mWidth + x;
+	uint64_t bit = uint64_t(1) << (index & 63);
+	if (mBits[index >> 6] & bit)
+		return;
+
+	mBits[index >> 6] |= bit;
+	mQueue.push_back(index);
+
+	uint32_t chunk = (y >> ChunkShift) * mChunksWidth + (x >> ChunkShift);
+	mChunkBits[chunk >> 6] |= uint64_t(1) << (chunk & 63);
+}
+
+bool DirtyNodeSet::IsMarked(uint32_t x, uint32_t y) const
+{
+	if (x >= mWidth || y >= mHeight)
+		return false;
+	uint32_t index = y * mWidth + x;
+	return (mBits[index >> 6] >> (index & 63)) & 1;
+}
+
+bool DirtyNodeSet::IsEmpty() const
+{
+	return mQueue.empty();
+}
+
+bool DirtyNodeSet::AnyInRect(const Rect& rec) const
+{
+	if (mQueue.empty())
+		return false;
+
+	Rect clipRec = rec.GetIntersection(Rect::FromXYWH(0, 0, mWidth, mHeight));
+	if (clipRec.w <= 0 || clipRec.h <= 0)
+		return false;
+
+	uint32_t cx1 = clipRec.GetLeft() >> ChunkShift;
+	uint32_t cx2 = (clipRec.GetRight() - 1) >> ChunkShift;
+	uint32_t cy1 = clipRec.GetTop() >> ChunkShift;
+	uint32_t cy2 = (clipRec.GetBottom() - 1) >> ChunkShift;
+	for (uint32_t cy = cy1; cy <= cy2; cy++)
+	{
+		for (uint32_t cx = cx1; cx <= cx2; cx++)
+		{
+			uint32_t chunk = cy * mChunksWidth + cx;
+			if ((mChunkBits[chunk >> 6] >> (chunk & 63)) & 1)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+const std::vector<uint32_t>& DirtyNodeSet::GetQueue() const
+{
+	return mQueue;
+}
+
+void DirtyNodeSet::Sort()
+{
+	std::sort(mQueue.begin(), mQueue.end());
+}
+
+void DirtyNodeSet::Clear()
+{
+	for (auto& index : mQueue)
+	{
+		mBits[index >> 6] = 0;
+		uint32_t x = index % mWidth;
+		uint32_t y = index / mWidth;
+		uint32_t chunk = (y >> ChunkShift) * mChunksWidth + (x >> ChunkShift);
+		mChunkBits[chunk >> 6] = 0;
+	}
+	mQueue.clear();
+}
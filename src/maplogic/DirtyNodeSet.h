@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "../screen/Rect.h"
+
+// set of nodes that need terrain redraw.
+// bitset keeps the queue free of duplicates, chunk bits allow to reject whole map areas quickly
+class DirtyNodeSet
+{
+public:
+
+	// chunks are 16x16 nodes
+	static const uint32_t ChunkShift = 4;
+
+	void SetSize(uint32_t w, uint32_t h);
+
+	void Mark(uint32_t x, uint32_t y);
+	bool IsMarked(uint32_t x, uint32_t y) const;
+	bool IsEmpty() const;
+
+	// conservative: may return true if dirty node is in the same chunk, but outside of the rect
+	bool AnyInRect(const Rect& rec) const;
+
+	// node indices (y * width + x)
+	const std::vector<uint32_t>& GetQueue() const;
+	// puts queue in row-major order, so that nodes are drawn in the same order as full scan would
+	void Sort();
+	// O(queue size), not O(map size)
+	void Clear();
+
+private:
+
+	uint32_t mWidth = 0;
+	uint32_t mHeight = 0;
+	uint32_t mChunksWidth = 0;
+
+	std::vector<uint64_t> mBits;
+	std::vector<uint64_t> mChunkBits;
+	std::vector<uint32_t> mQueue;
+
+};
@@ -0,0 +1,113 @@
+#include "LineOfSight.h"
+#include "MapLogic.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+const std::vector<LineOfSight::Entry>& LineOfSight::GetTable(int32_t radius)
+{
+	// built once, on first use
+	static struct Tables
+	{
+		std::vector<Entry> mData[MaxRadius + 1];
+		Tables()
+		{
+			for (int32_t r = 0; r <= MaxRadius; r++)
+			{
+				std::vector<Entry>& table = mData[r];
+				for (int32_t dy = -r; dy <= r; dy++)
+				{
+					for (int32_t dx = -r; dx <= r; dx++)
+					{
+						if (dx * dx + dy * dy > r * r + r)
+							continue;
+						Entry e;
+						e.mDX = dx;
+						e.mDY = dy;
+						e.mParent = -1;
+						e.mInvDistance = (dx || dy) ? 1.0f / (sqrtf(float(dx * dx + dy * dy)) * 32) : 0;
+						table.push_back(e);
+					}
+				}
+
+				// ring by ring, so that parent (one step closer on the ray) always comes first
+				std::stable_sort(table.begin(), table.end(), [](const Entry& a, const Entry& b) {
+					int32_t ringA = std::max(abs(a.mDX), abs(a.mDY));
+					int32_t ringB = std::max(abs(b.mDX), abs(b.mDY));
+					if (ringA != ringB)
+						return ringA < ringB;
+					return a.mDX * a.mDX + a.mDY * a.mDY < b.mDX * b.mDX + b.mDY * b.mDY;
+				});
+
+				int32_t size = r * 2 + 1;
+				std::vector<int32_t> indices(size * size, -1);
+				for (size_t i = 0; i < table.size(); i++)
+					indices[(table[i].mDY + r) * size + (table[i].mDX + r)] = i;
+
+				for (size_t i = 1; i < table.size(); i++)
+				{
+					Entry& e = table[i];
+					int32_t ring = std::max(abs(e.mDX), abs(e.mDY));
+					int32_t px = int32_t(lroundf(float(e.mDX) * (ring - 1) / ring));
+					int32_t py = int32_t(lroundf(float(e.mDY) * (ring - 1) / ring));
+					e.mParent = indices[(py + r) * size + (px + r)];
+				}
+			}
+		}
+	} tables;
+
+	if (radius < 0) radius = 0;
+	if (radius > MaxRadius) radius = MaxRadius;
+	return tables.mData[radius];
+}
+
+void LineOfSight::Trace(MapLogic* logic, int32_t x, int32_t y, int32_t radius, int32_t eyeHeight, std::vector<uint32_t>& out)
+{
+	int32_t w = logic->GetWidth();
+	int32_t h = logic->GetHeight();
+	if (x < 0 || y < 0 || x >= w || y >= h)
+		return;
+
+	const std::vector<Entry>& table = GetTable(radius);
+	mHorizon.resize(table.size());
+
+	const float occluded = std::numeric_limits<float>::infinity();
+	const int8_t* heights = logic->GetHeights();
+	const uint16_t* flags = logic->GetFlags();
+	float eye = float(heights[y * w + x] + eyeHeight);
+
+	// center is always seen
+	mHorizon[0] = -occluded;
+	out.push_back(y * w + x);
+
+	for (size_t i = 1; i < table.size(); i++)
+	{
+		const Entry& e = table[i];
+		float parentHorizon = mHorizon[e.mParent];
+		if (parentHorizon == occluded)
+		{
+			mHorizon[i] = occluded;
+			continue;
+		}
+
+		int32_t nx = x + e.mDX;
+		int32_t ny = y + e.mDY;
+		if (nx < 0 || ny < 0 || nx >= w || ny >= h)
+		{
+			mHorizon[i] = occluded;
+			continue;
+		}
+
+		uint32_t index = ny * w + nx;
+		float slope = (heights[index] - eye) * e.mInvDistance;
+		if (slope < parentHorizon)
+		{
+			// below the horizon, but higher nodes further on the ray may still be seen
+			mHorizon[i] = parentHorizon;
+			continue;
+		}
+
+		out.push_back(index);
+		mHorizon[i] = (flags[index] & MapNode::BlockedTerrain) ? occluded : slope;
+	}
+}
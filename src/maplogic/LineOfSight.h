@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class MapLogic;
+
+// height-aware line of sight.
+// for every radius, nodes of the circle are precalculated in traversal order, each one linked to the previous node on its ray.
+// tracing is then a single pass over the table: a node is seen if it rises above the horizon of its parent,
+// and everything behind BlockedTerrain is cut off without looking at the map
+class LineOfSight
+{
+public:
+
+	// tables are precalculated for every radius up to this
+	static const int32_t MaxRadius = 32;
+
+	struct Entry
+	{
+		int16_t mDX;
+		int16_t mDY;
+		int32_t mParent; // -1 for the center
+		float mInvDistance; // 1 / distance in pixels
+	};
+
+	static const std::vector<Entry>& GetTable(int32_t radius);
+
+	// appends indices (y * width + x) of visible nodes to out
+	void Trace(MapLogic* logic, int32_t x, int32_t y, int32_t radius, int32_t eyeHeight, std::vector<uint32_t>& out);
+
+private:
+
+	// highest slope seen along the ray, per table entry
+	std::vector<float> mHorizon;
+
+};
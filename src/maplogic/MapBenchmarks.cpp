@@ -0,0 +1,68 @@
+#include "MapBenchmarks.h"
+
+#ifdef ALLODS_BENCHMARKS
+
+#include "MapLogic.h"
+#include "LineOfSight.h"
+#include "../logging.h"
+#include <cstdlib>
+
+static double MillisecondsSince(uint64_t timeStart)
+{
+	return double(SDL_GetPerformanceCounter() - timeStart) * 1000 / SDL_GetPerformanceFrequency();
+}
+
+void BenchmarkLineOfSight(MapLogic* logic)
+{
+	LineOfSight los;
+	std::vector<uint32_t> traced;
+	uint32_t numSources = 256;
+	uint32_t numTraced = 0;
+	uint64_t timeStart = SDL_GetPerformanceCounter();
+	for (uint32_t i = 0; i < numSources; i++)
+	{
+		traced.clear();
+		los.Trace(logic, rand() % logic->GetWidth(), rand() % logic->GetHeight(), 8, MapVision::EyeHeight, traced);
+		numTraced += traced.size();
+	}
+	Printf("Line of sight: %u sources in %.3f ms (%u nodes seen)", numSources, MillisecondsSince(timeStart), numTraced);
+}
+
+void BenchmarkOccupancy(MapLogic* logic)
+{
+	// real objects, so that unlinking and linking goes through node flags, occupancy and object grid like in game
+	std::vector<MapObject*> objects;
+	uint32_t numObjects = 10000;
+	for (uint32_t i = 0; i < numObjects; i++)
+		objects.push_back(logic->CreateObject<MapObject>());
+	uint32_t numTicks = 100;
+	uint64_t timeStart = SDL_GetPerformanceCounter();
+	for (uint32_t tick = 0; tick < numTicks; tick++)
+	{
+		// SetPosition is UnlinkFromWorld and LinkToWorld at the new position
+		for (auto& obj : objects)
+			obj->SetPosition(rand() % logic->GetWidth(), rand() % logic->GetHeight());
+	}
+	double msMove = MillisecondsSince(timeStart);
+	for (auto& obj : objects)
+		logic->DeleteObject(obj);
+	Printf("Occupancy: %u objects moved %u times in %.3f ms", numObjects, numTicks, msMove);
+}
+
+void BenchmarkObjects(MapLogic* logic)
+{
+	std::vector<MapObject*> objects;
+	uint32_t numObjects = 10000;
+	uint64_t timeStart = SDL_GetPerformanceCounter();
+	for (uint32_t i = 0; i < numObjects; i++)
+		objects.push_back(logic->CreateObject<MapObject>());
+	double msCreate = MillisecondsSince(timeStart);
+	MapObjectHandle first = objects[0]->GetHandle();
+	timeStart = SDL_GetPerformanceCounter();
+	for (auto& obj : objects)
+		logic->DeleteObject(obj);
+	double msDelete = MillisecondsSince(timeStart);
+	Printf("Objects: %u created in %.3f ms, deleted in %.3f ms, stale handle %s", numObjects, msCreate, msDelete, logic->GetObject(first) ? "resolves" : "is null");
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,20 @@
+#pragma once
+
+// one-off measurements of map internals, results are printed to the log. only debug builds have them,
+// map view binds them to keys there. they are posted to MapLogic and leave the map as it was
+#ifdef _DEBUG
+#define ALLODS_BENCHMARKS 1
+#endif
+
+#ifdef ALLODS_BENCHMARKS
+
+class MapLogic;
+
+// line of sight from 256 random nodes, without touching vision state
+void BenchmarkLineOfSight(MapLogic* logic);
+// 10000 objects linked to random nodes 100 times, then deleted
+void BenchmarkOccupancy(MapLogic* logic);
+// 10000 objects created and deleted in creation order, then a stale handle is resolved
+void BenchmarkObjects(MapLogic* logic);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include "MapLight.h"
+#include <vector>
+#include <cmath>
+
+const int32_t MapLight::MaxRadius;
+
+Rect MapLight::GetBounds() const
+{
+	if (!mIsActive || !mIntensity)
+		return Rect::FromXYWH(mX, mY, 0, 0);
+	return Rect::FromLTRB(mX - mRadius, mY - mRadius, mX + mRadius + 1, mY + mRadius + 1);
+}
+
+const uint16_t* MapLight::GetKernel(int32_t radius)
+{
+	// built once, on first use
+	static struct Kernels
+	{
+		std::vector<uint16_t> mData[MaxRadius + 1];
+		Kernels()
+		{
+			for (int32_t r = 0; r <= MaxRadius; r++)
+			{
+				int32_t size = r * 2 + 1;
+				mData[r].resize(size * size);
+				for (int32_t y = 0; y < size; y++)
+				{
+					for (int32_t x = 0; x < size; x++)
+					{
+						// quadratic falloff, zero at radius + 1
+						float d = sqrtf(float((x - r) * (x - r) + (y - r) * (y - r))) / (r + 1);
+						float f = (d < 1) ? (1 - d) * (1 - d) : 0;
+						mData[r][y * size + x] = uint16_t(f * 256 + 0.5f);
+					}
+				}
+			}
+		}
+	} kernels;
+
+	if (radius < 0) radius = 0;
+	if (radius > MaxRadius) radius = MaxRadius;
+	return kernels.mData[radius].data();
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include "../screen/Rect.h"
+
+// point light stamped into terrain light map of every view
+struct MapLight
+{
+
+	// kernels are precalculated for every radius up to this
+	static const int32_t MaxRadius = 16;
+
+	int32_t mX;
+	int32_t mY;
+	int32_t mRadius;
+	int32_t mIntensity; // relative shade at the center, -128 - 127
+	bool mIsActive;
+
+	// nodes affected by this light
+	Rect GetBounds() const;
+
+	// (2r+1)x(2r+1) falloff values, 0 - 256
+	static const uint16_t* GetKernel(int32_t radius);
+
+};
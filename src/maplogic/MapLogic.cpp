@@ -2,13 +2,14 @@
 #include "../MemoryStream.h"
 #include "../Application.h"
 #include "../data/AlmLevel.h"
-#include "../mapview/MapView.h"
 #include "MapObstacle.h"
+#include <algorithm>
 
 MapLogic::MapLogic(const std::string& path)
 {
 
 	mIsValid = false;
+	SDL_AtomicSet(&mExiting, 0);
 
 	MemoryStream ms;
 	if (!Application::GetInstance()->GetResources()->ReadFile(ms, path))
@@ -29,24 +30,16 @@ MapLogic::MapLogic(const std::string& path)
 	mSolarAngle = alm.mInfo.mSolarAngle;
 	mWidth = alm.mInfo.mWidth;
 	mHeight = alm.mInfo.mHeight;
-	mNodes.resize(mWidth * mHeight);
-	
-	MapNode* nodes = GetNodes();
-
-	uint16_t* tiles = alm.mTiles.data();
-	int8_t* heights = alm.mHeights.data();
-	for (int y = 0; y < mHeight; y++)
-	{
-		for (int x = 0; x < mWidth; x++)
-		{
-			nodes->mTile = *tiles++;
-			nodes->mHeight = *heights++;
-			nodes->mFlags = 0;
-			nodes++;
-		}
-	}
+	mTiles = alm.mTiles;
+	mHeights = alm.mHeights;
+	mFlags.assign(mWidth * mHeight, 0);
+	mFlagRows.assign(mHeight, mFlagsVersion);
+	mDirtyNodes.SetSize(mWidth, mHeight);
+	mOccupancy.SetSize(mWidth, mHeight);
+	mObjectGrid.SetSize(mWidth, mHeight);
+	mVision.SetLogic(this);
+	mTimeOfDay.SetFromMap(alm.mInfo.mTimeOfDay, alm.mInfo.mDarkness, alm.mInfo.mContrast);
 
-	nodes = GetNodes();
 	uint8_t* obstacles = alm.mObstacles.data();
 	for (int y = 0; y < mHeight; y++)
 	{
@@ -55,10 +48,11 @@ MapLogic::MapLogic(const std::string& path)
 			uint8_t obstacleID = *obstacles++;
 			if (obstacleID > 0)
 			{
-				MapObstacle* ob = new MapObstacle(this, obstacleID - 1);
+				MapObstacle* ob = CreateObject<MapObstacle>(obstacleID - 1);
 				if (!ob->IsValid())
 				{
 					Printf("Warning: invalid Obstacle ID %u", obstacleID);
+					DeleteObject(ob);
 					continue;
 				}
 				AddObject(ob);
@@ -76,11 +70,20 @@ MapLogic::MapLogic(const std::string& path)
 MapLogic::~MapLogic()
 {
 
-	// for now do-nothing, but later we will need to deinitialize all objects
-	std::forward_list<MapObject*> objects = mAllObjects;
+	Stop();
+
+	// the whole map goes away, so objects don't unlink from nodes or free their handles one by one.
+	// pooled objects are only destroyed, their memory is released with the pools, block by block
+	mTearingDown = true;
+	for (auto& obj : mAllObjects)
+	{
+		if (obj->mPool)
+			obj->~MapObject();
+		else delete obj;
+	}
 	mAllObjects.clear();
-	for (auto& obj : objects)
-		delete obj;
+	for (auto& pool : mPools)
+		delete pool.second;
 
 }
 
@@ -89,9 +92,52 @@ bool MapLogic::IsValid()
 	return mIsValid;
 }
 
-MapNode* MapLogic::GetNodes()
+uint16_t* MapLogic::GetTiles()
+{
+	return mTiles.data();
+}
+
+int8_t* MapLogic::GetHeights()
+{
+	return mHeights.data();
+}
+
+uint16_t* MapLogic::GetFlags()
+{
+	return mFlags.data();
+}
+
+void MapLogic::InvalidateFlags(int32_t y)
 {
-	return mNodes.data();
+	if (y < 0 || y >= mHeight)
+		return;
+	mFlagRows[y] = mFlagsVersion;
+}
+
+NodeOccupancy::Range MapLogic::GetObjectsAt(int32_t x, int32_t y)
+{
+	if (x < 0 || y < 0 || x >= mWidth || y >= mHeight)
+		return mOccupancy.GetObjects(NodeOccupancy::None);
+	return mOccupancy.GetObjects(y * mWidth + x);
+}
+
+void MapLogic::LinkObject(int32_t x, int32_t y, MapObject* obj)
+{
+	mOccupancy.Link(obj, y * mWidth + x, obj->mLinks);
+	mObjectsVersion++;
+}
+
+void MapLogic::UnlinkObject(MapObject* obj)
+{
+	mOccupancy.UnlinkAll(obj->mLinks);
+	mObjectsVersion++;
+}
+
+void MapLogic::InvalidateNode(int32_t x, int32_t y)
+{
+	if (x < 0 || y < 0 || x >= mWidth || y >= mHeight)
+		return;
+	mDirtyNodes.Mark(x, y);
 }
 
 uint8_t MapLogic::GetSpeed()
@@ -108,35 +154,271 @@ uint8_t MapLogic::SetSpeed(uint8_t speed)
 	return speed;
 }
 
-void MapLogic::AttachView(MapView* view)
+void MapLogic::Start()
+{
+	if (mThread != nullptr)
+		return;
+	SDL_AtomicSet(&mExiting, 0);
+	mThread = new SimulationThread(this);
+	mThread->Start();
+}
+
+void MapLogic::Stop()
+{
+	if (mThread == nullptr)
+		return;
+	SDL_AtomicSet(&mExiting, 1);
+	mWakeUp.Post();
+	mThread->Wait();
+	delete mThread;
+	mThread = nullptr;
+	// nobody else will run them
+	RunMessages();
+}
+
+bool MapLogic::IsRunning()
+{
+	return mThread != nullptr;
+}
+
+void MapLogic::RunSimulation()
+{
+	while (!SDL_AtomicGet(&mExiting))
+	{
+		Tick();
+		// sleep until the next fixed tick is due, messages wake up earlier
+		uint64_t now = Application::GetMicroTicks();
+		uint64_t next = mLastTime + 1000000 / (5 * (mSpeed + 1));
+		if (next > now)
+			mWakeUp.WaitTimeout(uint32_t((next - now + 999) / 1000));
+	}
+}
+
+void MapLogic::Post(const Message& message)
+{
+	RLock lock(mMessagesMutex);
+	mMessages.push_back(message);
+	lock.Unlock();
+	mWakeUp.Post();
+}
+
+void MapLogic::Call(const Message& message)
 {
-	// check if not attached already
-	for (auto& v : mViews)
+	if (!IsRunning())
 	{
-		if (v == view)
+		RunMessages();
+		message(this);
+		return;
+	}
+
+	Semaphore done;
+	Post([&message, &done](MapLogic* logic) {
+		message(logic);
+		done.Post();
+	});
+	done.Wait();
+}
+
+bool MapLogic::RunMessages()
+{
+	// messages may post more messages, those run next time
+	RLock lock(mMessagesMutex);
+	mMessagesToRun.swap(mMessages);
+	lock.Unlock();
+	if (mMessagesToRun.empty())
+		return false;
+	for (auto& message : mMessagesToRun)
+		message(this);
+	mMessagesToRun.clear();
+	return true;
+}
+
+void MapLogic::AttachView(MapSnapshotBuffer* snapshots)
+{
+	Post([snapshots](MapLogic* logic) {
+		// check if not attached already
+		if (logic->GetViewLink(snapshots))
 			return;
+		ViewLink link;
+		link.mSnapshots = snapshots;
+		link.mVisibleRect = Rect::FromXYWH(0, 0, 0, 0);
+		// first snapshot has everything
+		link.mChanges.mAll = true;
+		logic->mViews.push_back(link);
+	});
+}
+
+void MapLogic::DetachView(MapSnapshotBuffer* snapshots)
+{
+	Call([snapshots](MapLogic* logic) {
+		for (std::vector<ViewLink>::iterator it = logic->mViews.begin();
+			it != logic->mViews.end(); ++it)
+		{
+			if (it->mSnapshots == snapshots)
+			{
+				logic->mViews.erase(it);
+				return;
+			}
+		}
+	});
+}
+
+void MapLogic::SetViewRect(MapSnapshotBuffer* snapshots, const Rect& rect)
+{
+	Post([snapshots, rect](MapLogic* logic) {
+		ViewLink* link = logic->GetViewLink(snapshots);
+		if (link)
+			link->mVisibleRect = rect;
+	});
+}
+
+MapLogic::ViewLink* MapLogic::GetViewLink(MapSnapshotBuffer* snapshots)
+{
+	for (auto& link : mViews)
+	{
+		if (link.mSnapshots == snapshots)
+			return &link;
+	}
+	return nullptr;
+}
+
+void MapLogic::Publish()
+{
+	// node changes are collected once and given to every view
+	mDirtyNodes.Sort();
+	mChanges.mNodes.insert(mChanges.mNodes.end(), mDirtyNodes.GetQueue().begin(), mDirtyNodes.GetQueue().end());
+	mDirtyNodes.Clear();
+	if (mCapture.mObjectsVersion != mObjectsVersion)
+		CaptureObjects();
+
+	for (auto& link : mViews)
+	{
+		// the view may skip snapshots, so changes pile up until it takes one
+		if (link.mSnapshots->IsAcknowledged())
+			link.mChanges.Clear();
+		link.mChanges.Append(mChanges);
+		FillSnapshot(link.mSnapshots->GetBack(), link.mChanges);
+		link.mSnapshots->Publish();
 	}
-	mViews.push_back(view);
+	mChanges.Clear();
+	mFlagsVersion++;
 }
 
-void MapLogic::DetachView(MapView* view)
+void MapLogic::FillSnapshot(MapSnapshot& out, const MapSnapshotChanges& changes)
 {
-	for (std::vector<MapView*>::iterator it = mViews.begin();
-		it != mViews.end(); ++it)
+	out.mTick = mTick;
+	// tiles never change during play
+	if (out.mTiles.size() != mTiles.size())
+		out.mTiles = mTiles;
+	if (out.mHeightsVersion != mHeightsVersion)
+	{
+		out.mHeights = mHeights;
+		out.mHeightsVersion = mHeightsVersion;
+	}
+	// vision changes flags all the time, but only around sources
+	if (out.mFlags.size() != mFlags.size())
 	{
-		if ((*it) == view)
+		out.mFlags = mFlags;
+		out.mFlagRows = mFlagRows;
+	}
+	else
+	{
+		for (uint32_t y = 0; y < mHeight; y++)
 		{
-			mViews.erase(it);
-			return;
+			if (out.mFlagRows[y] == mFlagRows[y])
+				continue;
+			std::copy(mFlags.begin() + y * mWidth, mFlags.begin() + (y + 1) * mWidth, out.mFlags.begin() + y * mWidth);
+			out.mFlagRows[y] = mFlagRows[y];
 		}
 	}
+	if (out.mLightsVersion != mLightsVersion)
+	{
+		out.mLights = mLights;
+		out.mLightsVersion = mLightsVersion;
+	}
+
+	out.mLightTint = mTimeOfDay.GetTint();
+	out.mLightBrightness = mTimeOfDay.GetBrightness();
+	out.mLightContrast = mTimeOfDay.GetContrast();
+
+	if (out.mObjectsVersion != mCapture.mObjectsVersion)
+	{
+		// only chunks captured since this snapshot had them
+		out.mObjectChunks.resize(mCapture.mObjectChunks.size());
+		out.mObjectSlots.resize(mCapture.mObjectSlots.size());
+		for (uint32_t i = 0; i < mCapture.mObjectChunks.size(); i++)
+		{
+			const MapSnapshot::ObjectChunk& chunk = mCapture.mObjectChunks[i];
+			MapSnapshot::ObjectChunk& outChunk = out.mObjectChunks[i];
+			if (outChunk.mCaptured == chunk.mCaptured)
+				continue;
+			outChunk = chunk;
+			for (uint32_t j = 0; j < chunk.mObjects.size(); j++)
+			{
+				MapSnapshot::ObjectSlot& slot = out.mObjectSlots[chunk.mObjects[j].mHandle.mIndex];
+				slot.mChunk = i;
+				slot.mIndex = j;
+			}
+		}
+		out.mChunksWidth = mCapture.mChunksWidth;
+		out.mMaxObjectSize = mCapture.mMaxObjectSize;
+		out.mObjectsVersion = mCapture.mObjectsVersion;
+	}
+
+	out.mChanges = changes;
+}
+
+void MapLogic::CaptureObjects()
+{
+	mCaptureVersion++;
+	mCapture.mObjectChunks.resize(mObjectGrid.GetChunksWidth() * mObjectGrid.GetChunksHeight());
+	mCapture.mObjectSlots.resize(mObjectSlots.size());
+
+	// chunks that objects were linked into or unlinked from are captured whole
+	for (uint32_t cy = 0; cy < mObjectGrid.GetChunksHeight(); cy++)
+	{
+		for (uint32_t cx = 0; cx < mObjectGrid.GetChunksWidth(); cx++)
+		{
+			uint32_t index = cy * mObjectGrid.GetChunksWidth() + cx;
+			MapSnapshot::ObjectChunk& chunk = mCapture.mObjectChunks[index];
+			if (chunk.mVersion == mObjectGrid.GetChunkVersion(cx, cy))
+				continue;
+			const std::vector<MapObject*>& objects = mObjectGrid.GetChunkObjects(cx, cy);
+			chunk.mObjects.resize(objects.size());
+			for (uint32_t i = 0; i < objects.size(); i++)
+			{
+				objects[i]->CaptureState(chunk.mObjects[i]);
+				MapSnapshot::ObjectSlot& slot = mCapture.mObjectSlots[objects[i]->GetHandle().mIndex];
+				slot.mChunk = index;
+				slot.mIndex = i;
+			}
+			chunk.mVersion = mObjectGrid.GetChunkVersion(cx, cy);
+			chunk.mCaptured = mCaptureVersion;
+		}
+	}
+
+	// everywhere else only objects that changed look
+	for (auto& handle : mChanges.mObjects)
+	{
+		MapObject* obj = GetObject(handle);
+		MapObjectState* state = mCapture.GetObject(handle);
+		if (!obj || !state)
+			continue;
+		obj->CaptureState(*state);
+		mCapture.mObjectChunks[mCapture.mObjectSlots[handle.mIndex].mChunk].mCaptured = mCaptureVersion;
+	}
+
+	mCapture.mChunksWidth = mObjectGrid.GetChunksWidth();
+	mCapture.mMaxObjectSize = mObjectGrid.GetMaxObjectSize();
+	mCapture.mObjectsVersion = mObjectsVersion;
 }
 
 void MapLogic::AddObject(MapObject* obj)
 {
 	if (obj->mIsAdded)
 		return;
-	mObjects.push_front(obj);
+	obj->mTickIndex = mObjects.size();
+	mObjects.push_back(obj);
 	obj->mIsAdded = true;
 }
 
@@ -144,10 +426,91 @@ void MapLogic::RemoveObject(MapObject* obj)
 {
 	if (!obj->mIsAdded)
 		return;
-	mObjects.remove(obj);
+	MapObject* last = mObjects.back();
+	mObjects[obj->mTickIndex] = last;
+	last->mTickIndex = obj->mTickIndex;
+	mObjects.pop_back();
 	obj->mIsAdded = false;
 }
 
+void MapLogic::DeleteObject(MapObject* obj)
+{
+	ObjectPoolBase* pool = obj->mPool;
+	if (!pool)
+	{
+		delete obj;
+		return;
+	}
+
+	// address of the most derived object is what the pool handed out
+	void* p = dynamic_cast<void*>(obj);
+	obj->~MapObject();
+	pool->Free(p);
+}
+
+MapObject* MapLogic::GetObject(const MapObjectHandle& handle)
+{
+	if (handle.mIndex >= mObjectSlots.size())
+		return nullptr;
+	const ObjectSlot& slot = mObjectSlots[handle.mIndex];
+	if (slot.mGeneration != handle.mGeneration)
+		return nullptr;
+	return slot.mObject;
+}
+
+uint32_t MapLogic::GetObjectCount()
+{
+	return mAllObjects.size();
+}
+
+const ObjectGrid& MapLogic::GetObjectGrid()
+{
+	return mObjectGrid;
+}
+
+void MapLogic::InvalidateObjectDisplay(MapObject* obj)
+{
+	mChanges.mObjects.push_back(obj->GetHandle());
+	mObjectsVersion++;
+}
+
+void MapLogic::RegisterObject(MapObject* obj)
+{
+	uint32_t index;
+	if (!mFreeObjectSlots.empty())
+	{
+		index = mFreeObjectSlots.back();
+		mFreeObjectSlots.pop_back();
+	}
+	else
+	{
+		index = mObjectSlots.size();
+		ObjectSlot slot;
+		slot.mGeneration = 0;
+		mObjectSlots.push_back(slot);
+	}
+
+	mObjectSlots[index].mObject = obj;
+	obj->mHandle.mIndex = index;
+	obj->mHandle.mGeneration = mObjectSlots[index].mGeneration;
+
+	obj->mAllIndex = mAllObjects.size();
+	mAllObjects.push_back(obj);
+}
+
+void MapLogic::UnregisterObject(MapObject* obj)
+{
+	ObjectSlot& slot = mObjectSlots[obj->mHandle.mIndex];
+	slot.mObject = nullptr;
+	slot.mGeneration++;
+	mFreeObjectSlots.push_back(obj->mHandle.mIndex);
+
+	MapObject* last = mAllObjects.back();
+	mAllObjects[obj->mAllIndex] = last;
+	last->mAllIndex = obj->mAllIndex;
+	mAllObjects.pop_back();
+}
+
 int8_t MapLogic::GetHeightAt(float_t x, float_t y)
 {
 	
@@ -162,7 +525,7 @@ int8_t MapLogic::GetHeightAt(float_t x, float_t y)
 	float xF = x - xI;
 	float yF = y - yI;
 
-	MapNode* nodes = GetNodes() + yI * mWidth + xI;
+	int8_t* heights = GetHeights() + yI * mWidth + xI;
 
 	if (xF > 0 || yF > 0)
 	{
@@ -170,41 +533,190 @@ int8_t MapLogic::GetHeightAt(float_t x, float_t y)
 		if (xI + 1 >= mWidth || yI + 1 >= mHeight)
 			return 0;
 
-		MapNode& node1 = *nodes;
-		MapNode& node2 = *(nodes+1);
-		MapNode& node3 = *(nodes+mWidth);
-		MapNode& node4 = *(nodes+mWidth+1);
+		int8_t height1 = *heights;
+		int8_t height2 = *(heights+1);
+		int8_t height3 = *(heights+mWidth);
+		int8_t height4 = *(heights+mWidth+1);
 
-		float lerpY1 = node3.mHeight * yF + node1.mHeight * (1 - yF);
-		float lerpY2 = node4.mHeight * yF + node2.mHeight * (1 - yF);
+		float lerpY1 = height3 * yF + height1 * (1 - yF);
+		float lerpY2 = height4 * yF + height2 * (1 - yF);
 
 		float lerpX = lerpY2 * xF + lerpY1 * (1 - xF);
 
 		return int8_t(lerpX);
 
 	}
-	else return nodes->mHeight;
+	else return *heights;
+
+}
+
+void MapLogic::SetHeight(int32_t x, int32_t y, int8_t height)
+{
+	if (x < 0 || y < 0 || x >= mWidth || y >= mHeight)
+		return;
+
+	mHeights[y * mWidth + x] = height;
+	mHeightsVersion++;
+
+	// geometry of every terrain node sharing this corner has changed
+	for (int32_t ny = y - 1; ny <= y; ny++)
+	{
+		for (int32_t nx = x - 1; nx <= x; nx++)
+			InvalidateNode(nx, ny);
+	}
+
+	// views shade it again
+	mChanges.mShade.push_back(Rect::FromXYWH(x, y, 1, 1));
+
+	mVision.UpdateArea(Rect::FromXYWH(x, y, 1, 1));
+
+	// objects standing on terrain around this node have moved
+	std::vector<MapObject*> objects;
+	mObjectGrid.QueryRect(Rect::FromXYWH(x - 1, y - 1, 2, 2), objects);
+	for (auto& obj : objects)
+		InvalidateObjectDisplay(obj);
+}
+
+uint32_t MapLogic::AddLight(int32_t x, int32_t y, int32_t radius, int32_t intensity)
+{
+	MapLight light;
+	light.mX = x;
+	light.mY = y;
+	light.mRadius = std::max(0, std::min(MapLight::MaxRadius, radius));
+	light.mIntensity = std::max(-128, std::min(127, intensity));
+	light.mIsActive = true;
+
+	uint32_t id;
+	if (!mFreeLights.empty())
+	{
+		id = mFreeLights.back();
+		mFreeLights.pop_back();
+		mLights[id] = light;
+	}
+	else
+	{
+		id = mLights.size();
+		mLights.push_back(light);
+	}
+
+	UpdateLight(Rect::FromXYWH(x, y, 0, 0), light.GetBounds());
+	return id;
+}
+
+void MapLogic::MoveLight(uint32_t id, int32_t x, int32_t y)
+{
+	if (id >= mLights.size() || !mLights[id].mIsActive)
+		return;
+	MapLight& light = mLights[id];
+	if (light.mX == x && light.mY == y)
+		return;
+	Rect oldBounds = light.GetBounds();
+	light.mX = x;
+	light.mY = y;
+	UpdateLight(oldBounds, light.GetBounds());
+}
+
+void MapLogic::SetLight(uint32_t id, int32_t radius, int32_t intensity)
+{
+	if (id >= mLights.size() || !mLights[id].mIsActive)
+		return;
+	MapLight& light = mLights[id];
+	Rect oldBounds = light.GetBounds();
+	light.mRadius = std::max(0, std::min(MapLight::MaxRadius, radius));
+	light.mIntensity = std::max(-128, std::min(127, intensity));
+	UpdateLight(oldBounds, light.GetBounds());
+}
+
+void MapLogic::RemoveLight(uint32_t id)
+{
+	if (id >= mLights.size() || !mLights[id].mIsActive)
+		return;
+	MapLight& light = mLights[id];
+	Rect oldBounds = light.GetBounds();
+	light.mIsActive = false;
+	mFreeLights.push_back(id);
+	UpdateLight(oldBounds, light.GetBounds());
+}
+
+void MapLogic::RemoveAllLights()
+{
+	for (uint32_t i = 0; i < mLights.size(); i++)
+		RemoveLight(i);
+}
+
+const std::vector<MapLight>& MapLogic::GetLights()
+{
+	return mLights;
+}
+
+uint32_t MapLogic::AddVisionSource(int32_t x, int32_t y, int32_t radius, bool lineOfSight)
+{
+	return mVision.AddSource(x, y, radius, lineOfSight);
+}
+
+void MapLogic::MoveVisionSource(uint32_t id, int32_t x, int32_t y)
+{
+	mVision.MoveSource(id, x, y);
+}
+
+void MapLogic::RemoveVisionSource(uint32_t id)
+{
+	mVision.RemoveSource(id);
+}
+
+void MapLogic::UpdateLight(const Rect& oldBounds, const Rect& newBounds)
+{
+	// overlapping boxes are relit as one, otherwise separately
+	std::vector<Rect> rects;
+	bool oldEmpty = (oldBounds.w <= 0 || oldBounds.h <= 0);
+	bool newEmpty = (newBounds.w <= 0 || newBounds.h <= 0);
+	Rect overlap = oldBounds.GetIntersection(newBounds);
+	if (!oldEmpty && !newEmpty && overlap.w > 0 && overlap.h > 0)
+	{
+		rects.push_back(Rect::FromLTRB(std::min(oldBounds.GetLeft(), newBounds.GetLeft()),
+									   std::min(oldBounds.GetTop(), newBounds.GetTop()),
+									   std::max(oldBounds.GetRight(), newBounds.GetRight()),
+									   std::max(oldBounds.GetBottom(), newBounds.GetBottom())));
+	}
+	else
+	{
+		if (!oldEmpty) rects.push_back(oldBounds);
+		if (!newEmpty) rects.push_back(newBounds);
+	}
 
+	// views restamp them
+	mChanges.mLight.insert(mChanges.mLight.end(), rects.begin(), rects.end());
+	mLightsVersion++;
 }
 
 void MapLogic::Tick()
 {
+	bool changed = RunMessages();
+
+	uint64_t now = Application::GetMicroTicks();
 	if (mLastTime == 0)
-		mLastTime = Application::GetTicks();
+		mLastTime = now;
 
-	int64_t speedMult = 5 * (mSpeed + 1); // how many ticks in a single second
-	int64_t oneTick = 1000 / speedMult;
-	int64_t timePassed = (Application::GetTicks() - mLastTime) * speedMult;
-	if (timePassed > 1000)
+	uint64_t speedMult = 5 * (mSpeed + 1); // how many ticks in a single second
+	uint64_t oneTick = 1000000 / speedMult;
+	uint32_t ticks = 0;
+	while (now - mLastTime >= oneTick)
 	{
-		while (timePassed > 1000)
+		// after a long stall (loading, window drag) drop the backlog instead of running it all in one frame
+		if (ticks == MaxCatchUpTicks)
 		{
-			FixedTick();
-			timePassed -= 1000;
-			mLastTime += oneTick;
+			mLastTime = now;
+			break;
 		}
+
+		FixedTick();
+		mLastTime += oneTick;
+		ticks++;
 	}
 
+	if (changed || ticks)
+		Publish();
+
 }
 
 void MapLogic::SetDefaults()
@@ -214,19 +726,48 @@ void MapLogic::SetDefaults()
 
 void MapLogic::FixedTick()
 {
-	for (auto& v : mViews)
-		v->FixedTick();
+	mTick++;
+
+	// lighting goes to views with the next snapshot
+	mTimeOfDay.Advance();
 	
-	std::forward_list<MapObject*> toErase;
+	std::vector<MapObject*> toErase;
 	
-	for (auto& obj : mObjects)
+	// by index, Tick() may add objects
+	for (size_t i = 0; i < mObjects.size(); i++)
 	{
-		if (!obj->Tick())
-			toErase.push_front(obj);
+		if (!mObjects[i]->Tick())
+			toErase.push_back(mObjects[i]);
+	}
+
+	// non-active objects (trees...) are only updated while seen, once per tick even if several views see them
+	std::vector<MapObject*> visible;
+	for (auto& link : mViews)
+	{
+		visible.clear();
+		mObjectGrid.QueryRect(link.mVisibleRect, visible);
+		for (MapObject* obj : visible)
+		{
+			if (obj->IsAdded() || obj->mViewTick == mTick)
+				continue;
+			obj->mViewTick = mTick;
+			if (!obj->Tick())
+				toErase.push_back(obj);
+		}
 	}
 
 	for (auto& obj : toErase)
-		delete obj;
+		DeleteObject(obj);
+}
+
+uint32_t MapLogic::GetTimeOfDay()
+{
+	return mTimeOfDay.GetTime();
+}
+
+void MapLogic::SetTimeOfDay(uint32_t time)
+{
+	mTimeOfDay.SetTime(time);
 }
 
 uint32_t MapLogic::GetWidth()
@@ -3,8 +3,23 @@
 #include <string>
 #include <vector>
 #include <forward_list>
+#include <unordered_map>
+#include <typeindex>
+#include <utility>
+#include <functional>
 #include "MapObject.h"
+#include "DirtyNodeSet.h"
+#include "MapLight.h"
+#include "MapVision.h"
+#include "NodeOccupancy.h"
+#include "ObjectPool.h"
+#include "ObjectGrid.h"
+#include "TimeOfDay.h"
+#include "MapSnapshot.h"
+#include "../Thread.h"
 
+// node data is stored in MapLogic as separate arrays (tiles, heights, flags), so that full map passes only touch what they use.
+// objects occupying nodes are kept aside, since most nodes have none
 struct MapNode
 {
 
@@ -18,20 +33,14 @@ struct MapNode
 		Unblocked			= 0x0010,
 		DynamicGround		= 0x0020,
 		DynamicAir			= 0x0040,
-		BlockedTerrain		= 0x0080,
-		NeedRedraw			= 0x0100,
-		NeedRedrawFOW		= 0x0200
+		BlockedTerrain		= 0x0080
 	};
 
-	uint16_t mTile;
-	int8_t mHeight;
-	uint16_t mFlags;
-
-	std::forward_list<MapObject*> mObjects;
-
 };
 
-class MapView;
+// the simulation runs on its own thread once started. everything except Start, Stop, Post, Call and the view methods
+// is only called on that thread, by messages and objects. views only read map size and solar angle, which never change,
+// everything else comes to them in snapshots
 class MapLogic
 {
 public:
@@ -40,36 +49,171 @@ public:
 	~MapLogic();
 
 	bool IsValid();
+	// most fixed ticks run by a single Tick(), time beyond that is dropped
+	static const uint32_t MaxCatchUpTicks = 8;
+	// runs messages and due fixed ticks, then publishes snapshots if anything happened
 	void Tick();
 	void FixedTick();
 
+	// simulation thread calls Tick() until stopped. messages left after stopping are run by Stop()
+	void Start();
+	void Stop();
+	bool IsRunning();
+
+	// runs on the simulation thread before the next tick, in the order posted
+	typedef std::function<void(MapLogic* logic)> Message;
+	void Post(const Message& message);
+	// same, but waits until the message has run. runs right away if the simulation isn't running
+	void Call(const Message& message);
+
+	// views get their own snapshot buffer. these can be called from any thread, detach waits until the buffer is released
+	void AttachView(MapSnapshotBuffer* snapshots);
+	void DetachView(MapSnapshotBuffer* snapshots);
+	// objects in the view that aren't added (trees...) are ticked too
+	void SetViewRect(MapSnapshotBuffer* snapshots, const Rect& rect);
+
 	std::string GetMapName() { return mName; }
 	std::string GetMapAuthor() { return mAuthor; }
 	float_t GetSolarAngle() { return mSolarAngle; }
 	uint32_t GetWidth();
 	uint32_t GetHeight();
-	MapNode* GetNodes();
+
+	// node arrays, width * height elements each. whoever changes flags calls InvalidateFlags for the rows
+	uint16_t* GetTiles();
+	int8_t* GetHeights();
+	uint16_t* GetFlags();
+	void InvalidateFlags(int32_t y);
+	// objects occupying the node. range is invalidated when objects are linked
+	NodeOccupancy::Range GetObjectsAt(int32_t x, int32_t y);
+
+	// queues the terrain node for redraw in every view
+	void InvalidateNode(int32_t x, int32_t y);
 
 	uint8_t GetSpeed();
 	uint8_t SetSpeed(uint8_t speed);
 
-	void AttachView(MapView* view);
-	void DetachView(MapView* view);
+	// objects are created in per-class pools, and must be deleted with DeleteObject
+	template<typename T, typename... Args>
+	T* CreateObject(Args&&... args)
+	{
+		ObjectPool<T>* pool = GetPool<T>();
+		T* obj = new (pool->Allocate()) T(this, std::forward<Args>(args)...);
+		obj->mPool = pool;
+		return obj;
+	}
+	void DeleteObject(MapObject* obj);
 
 	void AddObject(MapObject* obj);
 	void RemoveObject(MapObject* obj);
+	// nullptr if the object was deleted
+	MapObject* GetObject(const MapObjectHandle& handle);
+	uint32_t GetObjectCount();
+	// linked objects by map area
+	const ObjectGrid& GetObjectGrid();
+	// object looks different, views will draw it again
+	void InvalidateObjectDisplay(MapObject* obj);
 
 	int8_t GetHeightAt(float_t x, float_t y);
+	// changes node height, updates terrain in all views
+	void SetHeight(int32_t x, int32_t y, int8_t height);
+
+	// dynamic lights. only the area touched by a change is relit
+	uint32_t AddLight(int32_t x, int32_t y, int32_t radius, int32_t intensity);
+	void MoveLight(uint32_t id, int32_t x, int32_t y);
+	void SetLight(uint32_t id, int32_t radius, int32_t intensity);
+	void RemoveLight(uint32_t id);
+	void RemoveAllLights();
+	const std::vector<MapLight>& GetLights();
+
+	// vision sources set Visible and Discovered flags in a circle around them, or only where line of sight reaches
+	uint32_t AddVisionSource(int32_t x, int32_t y, int32_t radius, bool lineOfSight = false);
+	void MoveVisionSource(uint32_t id, int32_t x, int32_t y);
+	void RemoveVisionSource(uint32_t id);
+
+	// time of day in fixed ticks since midnight. advances every fixed tick and drives lighting of all views
+	uint32_t GetTimeOfDay();
+	void SetTimeOfDay(uint32_t time);
 
 private:
 
 	//
 	void SetDefaults();
+	void UpdateLight(const Rect& oldBounds, const Rect& newBounds);
+	// used by MapObject when linking to world
+	void LinkObject(int32_t x, int32_t y, MapObject* obj);
+	void UnlinkObject(MapObject* obj);
+	// used by MapObject on creation and deletion
+	void RegisterObject(MapObject* obj);
+	void UnregisterObject(MapObject* obj);
+
+	template<typename T>
+	ObjectPool<T>* GetPool()
+	{
+		ObjectPoolBase*& pool = mPools[std::type_index(typeid(T))];
+		if (!pool)
+			pool = new ObjectPool<T>();
+		return static_cast<ObjectPool<T>*>(pool);
+	}
 
 	// internal
 	bool mIsValid;
 	uint64_t mLastTime = 0;
-	std::vector<MapView*> mViews;
+	uint32_t mTick = 0;
+
+	// simulation thread
+	class SimulationThread : public Thread
+	{
+		MapLogic* mLogic;
+
+	public:
+		SimulationThread(MapLogic* logic) : Thread("Simulation")
+		{
+			mLogic = logic;
+		}
+
+		virtual int Run()
+		{
+			mLogic->RunSimulation();
+			return 0;
+		}
+	};
+
+	void RunSimulation();
+	// returns true if any message was run
+	bool RunMessages();
+	SimulationThread* mThread = nullptr;
+	SDL_atomic_t mExiting;
+	// posted messages wake the thread up before the next tick is due
+	Semaphore mWakeUp;
+	Mutex mMessagesMutex;
+	std::vector<Message> mMessages;
+	std::vector<Message> mMessagesToRun;
+
+	// attached views. changes are kept until the view has taken a snapshot that had them
+	struct ViewLink
+	{
+		MapSnapshotBuffer* mSnapshots;
+		Rect mVisibleRect;
+		MapSnapshotChanges mChanges;
+	};
+	std::vector<ViewLink> mViews;
+	ViewLink* GetViewLink(MapSnapshotBuffer* snapshots);
+	// changes since the last publish, given to every view
+	MapSnapshotChanges mChanges;
+	void Publish();
+	void FillSnapshot(MapSnapshot& out, const MapSnapshotChanges& changes);
+	// parts of snapshots that are copied only when they change
+	uint32_t mHeightsVersion = 1;
+	uint32_t mLightsVersion = 1;
+	uint32_t mObjectsVersion = 1;
+	// version of every flags row. rows changed after a publish get the version of the next one
+	std::vector<uint32_t> mFlagRows;
+	uint32_t mFlagsVersion = 1;
+	// object states are captured once per change and copied to every view, chunk by chunk. a chunk is captured again
+	// when objects are linked into it or unlinked from it, otherwise only objects that changed look are
+	uint32_t mCaptureVersion = 0;
+	MapSnapshot mCapture;
+	void CaptureObjects();
 	
 	// map data
 	std::string mName;
@@ -79,11 +223,32 @@ private:
 	//
 	float_t mSolarAngle;
 	//
-	std::vector<MapNode> mNodes;
+	std::vector<uint16_t> mTiles;
+	std::vector<int8_t> mHeights;
+	std::vector<uint16_t> mFlags;
+	NodeOccupancy mOccupancy;
+	ObjectGrid mObjectGrid;
+	DirtyNodeSet mDirtyNodes;
+	std::vector<MapLight> mLights;
+	std::vector<uint32_t> mFreeLights;
+	MapVision mVision;
+	TimeOfDay mTimeOfDay;
 	// objects processed during Tick()
-	std::forward_list<MapObject*> mObjects;
-	// objects used for garbage collection
-	std::forward_list<MapObject*> mAllObjects;
+	std::vector<MapObject*> mObjects;
+	// objects used for garbage collection. removal swaps with the last one
+	std::vector<MapObject*> mAllObjects;
+	// handle table. generation is bumped every time the slot is freed
+	struct ObjectSlot
+	{
+		MapObject* mObject;
+		uint32_t mGeneration;
+	};
+	std::vector<ObjectSlot> mObjectSlots;
+	std::vector<uint32_t> mFreeObjectSlots;
+	// object storage, one pool per class
+	std::unordered_map<std::type_index, ObjectPoolBase*> mPools;
+	// set by the destructor, objects destroyed after it leave map state alone
+	bool mTearingDown = false;
 
 	friend class MapObject;
 
@@ -1,30 +1,22 @@
 #include "MapObject.h"
 #include "MapLogic.h"
-#include "../mapview/MapView.h"
 #include "../logging.h"
 
 MapObject::MapObject(MapLogic* logic)
 {
 	mLogic = logic;
-	mLogic->mAllObjects.push_front(this);
+	mLogic->RegisterObject(this);
 }
 
 MapObject::~MapObject()
 {
 
-	// perform "garbage collection"
-	for (std::forward_list<MapObject*>::iterator it = mLogic->mAllObjects.begin();
-		it != mLogic->mAllObjects.end(); ++it)
-	{
-		MapObject* obj = *it;
-		if (obj == this)
-			continue;
-		obj->CheckPointers(this);
-	}
-	mLogic->mAllObjects.remove(this);
-
+	// references to this object are handles, they go stale by themselves
+	if (mLogic->mTearingDown)
+		return;
 	UnlinkFromWorld();
 	mLogic->RemoveObject(this);
+	mLogic->UnregisterObject(this);
 
 }
 
@@ -40,18 +32,22 @@ void MapObject::LinkToWorld()
 		return;
 
 	uint16_t flags = GetNodeLinkFlags();
-	MapNode* nodes = mLogic->GetNodes() + mLogic->GetWidth() * mPosition.y + mPosition.x;
+	uint16_t* nodeFlags = mLogic->GetFlags() + mLogic->GetWidth() * mPosition.y + mPosition.x;
 	for (int32_t y = mPosition.y; y < mPosition.GetBottom(); y++)
 	{
 		for (int32_t x = mPosition.x; x < mPosition.GetRight(); x++)
 		{
-			nodes->mFlags |= flags;
-			nodes->mObjects.push_front(this);
-			nodes++;
+			*nodeFlags++ |= flags;
+			mLogic->LinkObject(x, y, this);
 		}
-		nodes += mLogic->GetWidth() - mPosition.w;
+		nodeFlags += mLogic->GetWidth() - mPosition.w;
+		if (flags)
+			mLogic->InvalidateFlags(y);
 	}
 
+	if (mPosition.w > 0 && mPosition.h > 0)
+		mLogic->mObjectGrid.Insert(this);
+
 	mIsLinked = true;
 
 }
@@ -63,22 +59,31 @@ void MapObject::UnlinkFromWorld()
 		return;
 
 	uint16_t flags = GetNodeLinkFlags();
-	MapNode* nodes = mLogic->GetNodes() + mLogic->GetWidth() * mPosition.y + mPosition.x;
+	uint16_t* nodeFlags = mLogic->GetFlags() + mLogic->GetWidth() * mPosition.y + mPosition.x;
 	for (int32_t y = mPosition.y; y < mPosition.GetBottom(); y++)
 	{
 		for (int32_t x = mPosition.x; x < mPosition.GetRight(); x++)
-		{
-			nodes->mFlags &= ~flags;
-			nodes->mObjects.remove(this);
-			nodes++;
-		}
-		nodes += mLogic->GetWidth() - mPosition.w;
+			*nodeFlags++ &= ~flags;
+		nodeFlags += mLogic->GetWidth() - mPosition.w;
+		if (flags)
+			mLogic->InvalidateFlags(y);
+	}
+	mLogic->UnlinkObject(this);
+	if (mGridChunk != 0xFFFFFFFF)
+	{
+		mLogic->mObjectGrid.Remove(this);
+		mGridChunk = 0xFFFFFFFF;
 	}
 
 	mIsLinked = false;
 
 }
 
+MapObjectHandle MapObject::GetHandle()
+{
+	return mHandle;
+}
+
 bool MapObject::IsLinked()
 {
 	return mIsLinked;
@@ -117,10 +122,6 @@ uint32_t MapObject::GetHeight()
 	return mHeight;
 }
 
-void MapObject::CheckPointers(MapObject* object)
-{
-}
-
 uint16_t MapObject::GetNodeLinkFlags()
 {
 	return 0;
@@ -131,26 +132,17 @@ bool MapObject::Tick()
 	return false;
 }
 
-void MapObject::CheckDraw(MapView* view)
-{
-
-	// draws something once (until next frame)
-	uint32_t rid = view->GetRenderID();
-	std::unordered_map<MapView*, uint32_t>::iterator rids = mRenderIDs.find(view);
-	if (rids == mRenderIDs.end() || rids->second != rid)
-	{
-		Draw(view);
-		mRenderIDs[view] = rid;
-	}
-
-}
-
 bool MapObject::HandleEvent(const SDL_Event* ev)
 {
 	return false;
 }
 
-void MapObject::Draw(MapView* view)
+void MapObject::CaptureState(MapObjectState& state)
 {
-
+	state.mHandle = mHandle;
+	state.mPosition = mPosition;
+	state.mDraw = nullptr;
+	state.mClass = nullptr;
+	state.mFrame = 0;
+	state.mHeight = 0;
 }
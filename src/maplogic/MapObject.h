@@ -2,10 +2,24 @@
 
 #include "../screen/Rect.h"
 #include "../screen/Point.h"
-#include <unordered_map>
+#include "NodeOccupancy.h"
 
 class MapView;
 class MapLogic;
+class ObjectPoolBase;
+struct MapObjectState;
+
+// weak reference to a MapObject. slot index plus generation, so it resolves to nullptr once the object is deleted
+struct MapObjectHandle
+{
+	uint32_t mIndex = 0xFFFFFFFF;
+	uint32_t mGeneration = 0;
+
+	bool IsNull() const { return mIndex == 0xFFFFFFFF; }
+	bool operator==(const MapObjectHandle& other) const { return mIndex == other.mIndex && mGeneration == other.mGeneration; }
+	bool operator!=(const MapObjectHandle& other) const { return !(*this == other); }
+};
+
 class MapObject
 {
 public:
@@ -15,6 +29,7 @@ public:
 
 	// logic
 	MapLogic* GetLogic();
+	MapObjectHandle GetHandle();
 	void LinkToWorld();
 	void UnlinkFromWorld();
 	bool IsLinked();
@@ -24,17 +39,13 @@ public:
 	uint32_t GetWidth();
 	uint32_t GetHeight();
 
-	// happens when some object is gone. we need to clear all references to this object
-	virtual void CheckPointers(MapObject* object);
-
 	// returns flags to set and clear. this is MapNode::MapNodeFlags
 	virtual uint16_t GetNodeLinkFlags();
 	virtual bool Tick();
 
-	// drawing
-	void CheckDraw(MapView* view);
+	// drawing. views draw objects from state captured after the object changed, see MapObjectState
 	virtual bool HandleEvent(const SDL_Event* ev);
-	virtual void Draw(MapView* view);
+	virtual void CaptureState(MapObjectState& state);
 
 private:
 
@@ -42,14 +53,28 @@ private:
 	bool mIsLinked = false;
 	bool mIsAdded = false;
 	Rect mPosition;
+	// head of this object's links in NodeOccupancy
+	uint32_t mLinks = NodeOccupancy::None;
+	// positions in MapLogic tables
+	MapObjectHandle mHandle;
+	uint32_t mAllIndex = 0;
+	uint32_t mTickIndex = 0;
+	// fixed tick when a view last ticked this object. views overlap, it's ticked once anyway
+	uint32_t mViewTick = 0;
 
 	uint32_t mWidth = 1;
 	uint32_t mHeight = 1;
 
 	void SetPosition(const Rect& pos);
 
-	std::unordered_map<MapView*, uint32_t> mRenderIDs;
+	// position in ObjectGrid
+	uint32_t mGridChunk = 0xFFFFFFFF;
+	uint32_t mGridIndex = 0;
+
+	// pool this object was created in, nullptr if created with new
+	ObjectPoolBase* mPool = nullptr;
 
 	friend class MapLogic;
+	friend class ObjectGrid;
 
 };
\ No newline at end of file
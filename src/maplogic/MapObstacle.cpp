@@ -35,12 +35,12 @@ bool MapObstacle::Tick()
 
 	const Rect& pos = GetPosition();
 	MapLogic* logic = GetLogic();
-	MapNode* nodes = logic->GetNodes() + logic->GetWidth() * pos.y + pos.x;
+	uint16_t* nodeFlags = logic->GetFlags() + logic->GetWidth() * pos.y + pos.x;
 	uint16_t anyVisible = 0;
 	for (int yCheck = 0; yCheck < 3; yCheck++)
 	{
-		anyVisible |= nodes->mFlags & MapNode::Visible;
-		nodes -= logic->GetWidth();
+		anyVisible |= *nodeFlags & MapNode::Visible;
+		nodeFlags -= logic->GetWidth();
 	}
 	if (!anyVisible) return true;
 
@@ -49,59 +49,76 @@ bool MapObstacle::Tick()
 	{
 		mFrame = (mFrame + 1) % (mClass->mFrames.size());
 		mTime = 0;
+		GetLogic()->InvalidateObjectDisplay(this);
 	}
 
 	return true;
 
 }
 
-void MapObstacle::Draw(MapView* view)
+void MapObstacle::CaptureState(MapObjectState& state)
 {
-	
+
+	MapObject::CaptureState(state);
 	if (mClass == nullptr)
 		return;
 
 	const Rect& pos = GetPosition();
-	// build x/y coordinates
-	int x = (pos.x - view->GetScrollX()) * 32 + 16;
-	int y = (pos.y - view->GetScrollY()) * 32 + 16 - GetLogic()->GetHeightAt(pos.x + 0.5, pos.y + 0.5);
+	state.mDraw = &DrawState;
+	state.mClass = mClass;
+	state.mFrame = mClass->mFrames[mFrame].mFrame;
+	state.mHeight = GetLogic()->GetHeightAt(pos.x + 0.5, pos.y + 0.5);
+
+}
+
+void MapObstacle::DrawState(MapView* view, const MapObjectState& state)
+{
 
-	mClass->mFile.CheckLoad(view);
+	ObstacleClass* cls = (ObstacleClass*)state.mClass;
+	const Rect& pos = state.mPosition;
+	// build x/y coordinates, in map pixels
+	int x = pos.x * 32 + 16;
+	int y = pos.y * 32 + 16 - state.mHeight;
 
-	Sprite256* sprite = mClass->mFile.mSprite;
+	cls->mFile.CheckLoad(view);
+
+	Sprite256* sprite = cls->mFile.mSprite;
 	if (sprite == nullptr)
 		return;
 
-	const CompoundPalette* pal = mClass->mFile.GetPalette(view);
-	uint32_t realFrame = mClass->mFrames[mFrame].mFrame;
+	const CompoundPalette* pal = cls->mFile.GetPalette(view);
+	uint32_t realFrame = state.mFrame;
 
 	int fw = sprite->GetWidth(realFrame);
 	int fh = sprite->GetHeight(realFrame);
 
-	int drawX = x - mClass->mCenterX * fw;
-	int drawY = y - mClass->mCenterY * fh;
+	int drawX = x - cls->mCenterX * fw;
+	int drawY = y - cls->mCenterY * fh;
 	float shadowOffs = 0.3;
 	int shadowOffsReal = shadowOffs * fh;
-	int shadowDrawX = x - mClass->mCenterX * fw + (-shadowOffsReal) * (1 - mClass->mCenterY);
-
-	const Color* palette = mClass->mFile.GetPalette(view)->GetPalette(32);
-	uint8_t r = palette[0].components.r;
+	int shadowDrawX = x - cls->mCenterX * fw + (-shadowOffsReal) * (1 - cls->mCenterY);
 
 	// draw sprite
-	view->EnqueueDrawCall(y, [sprite, drawX, drawY, realFrame, palette](MapView* view){
-		
-		DrawingContext ctx(Application::GetInstance()->GetScreen(), view->GetClipRect());
-		sprite->Draw(ctx, drawX, drawY, realFrame, palette);
-
-	});
+	MapDrawCommand cmd;
+	cmd.mKind = view->IsFusedFOW() ? MapDrawCommand::SpriteFOW : MapDrawCommand::Sprite;
+	cmd.mLevel = 32;
+	cmd.mShadowOffset = 0;
+	cmd.mSprite = sprite;
+	cmd.mFrame = realFrame;
+	cmd.mX = drawX;
+	cmd.mY = drawY;
+	cmd.mPalette = pal->GetPalette(32);
+	cmd.mCompoundPalette = pal;
+	cmd.mSortKey = y;
+	view->EnqueueDraw(cmd);
 
 	// draw shadow
-	view->EnqueueDrawCall(y-32, [sprite, shadowDrawX, drawY, realFrame](MapView* view) {
-
-		DrawingContext ctx(Application::GetInstance()->GetScreen(), view->GetClipRect());
-		sprite->DrawShadow(ctx, shadowDrawX, drawY, realFrame, 32, 2);
+	cmd.mKind = MapDrawCommand::Shadow;
+	cmd.mLevel = 2;
+	cmd.mShadowOffset = 32;
+	cmd.mX = shadowDrawX;
+	cmd.mSortKey = y - 32;
+	view->EnqueueDraw(cmd);
 
-	});
-	
 
 }
@@ -15,7 +15,9 @@ public:
 	virtual uint16_t GetNodeLinkFlags();
 
 	virtual bool Tick();
-	virtual void Draw(MapView* view);
+	virtual void CaptureState(MapObjectState& state);
+	// runs on the render thread
+	static void DrawState(MapView* view, const MapObjectState& state);
 
 private:
 
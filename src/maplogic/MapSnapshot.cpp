@@ -0,0 +1,142 @@
+#include "MapSnapshot.h"
+#include "ObjectGrid.h"
+#include <algorithm>
+
+const size_t MapSnapshotChanges::MaxSize;
+const uint32_t MapSnapshot::NoObject;
+const int MapSnapshotBuffer::NewFlag;
+const int MapSnapshotBuffer::IndexMask;
+
+void MapSnapshotChanges::Append(const MapSnapshotChanges& other)
+{
+	if (other.mAll)
+		mAll = true;
+	if (mAll)
+	{
+		Clear();
+		mAll = true;
+		return;
+	}
+
+	mNodes.insert(mNodes.end(), other.mNodes.begin(), other.mNodes.end());
+	mShade.insert(mShade.end(), other.mShade.begin(), other.mShade.end());
+	mLight.insert(mLight.end(), other.mLight.begin(), other.mLight.end());
+	mObjects.insert(mObjects.end(), other.mObjects.begin(), other.mObjects.end());
+
+	// cheaper to redraw everything than to go through this
+	if (mNodes.size() + mShade.size() + mLight.size() + mObjects.size() > MaxSize)
+	{
+		Clear();
+		mAll = true;
+	}
+}
+
+void MapSnapshotChanges::Clear()
+{
+	mAll = false;
+	mNodes.clear();
+	mShade.clear();
+	mLight.clear();
+	mObjects.clear();
+}
+
+/////////
+
+Rect MapSnapshot::GetChunkRect(const Rect& rect) const
+{
+	int32_t chunksHeight = mChunksWidth ? mObjectChunks.size() / mChunksWidth : 0;
+	int32_t left = std::max(0, rect.GetLeft() - mMaxObjectSize + 1) >> ObjectGrid::ChunkShift;
+	int32_t top = std::max(0, rect.GetTop() - mMaxObjectSize + 1) >> ObjectGrid::ChunkShift;
+	int32_t right = std::min(int32_t(mChunksWidth), ((rect.GetRight() - 1) >> ObjectGrid::ChunkShift) + 1);
+	int32_t bottom = std::min(chunksHeight, ((rect.GetBottom() - 1) >> ObjectGrid::ChunkShift) + 1);
+	return Rect::FromLTRB(left, top, right, bottom);
+}
+
+uint32_t MapSnapshot::GetChunkVersion(int32_t cx, int32_t cy) const
+{
+	return mObjectChunks[cy * mChunksWidth + cx].mVersion;
+}
+
+void MapSnapshot::QueryRect(const Rect& rect, std::vector<MapObjectHandle>& out) const
+{
+	if (rect.w <= 0 || rect.h <= 0)
+		return;
+	Rect chunkRect = GetChunkRect(rect);
+	for (int32_t cy = chunkRect.GetTop(); cy < chunkRect.GetBottom(); cy++)
+	{
+		for (int32_t cx = chunkRect.GetLeft(); cx < chunkRect.GetRight(); cx++)
+			QueryChunk(cx, cy, rect, out);
+	}
+}
+
+void MapSnapshot::QueryChunk(int32_t cx, int32_t cy, const Rect& rect, std::vector<MapObjectHandle>& out) const
+{
+	for (auto& state : mObjectChunks[cy * mChunksWidth + cx].mObjects)
+	{
+		const Rect& pos = state.mPosition;
+		if (pos.GetLeft() < rect.GetRight() && pos.GetRight() > rect.GetLeft() &&
+			pos.GetTop() < rect.GetBottom() && pos.GetBottom() > rect.GetTop())
+			out.push_back(state.mHandle);
+	}
+}
+
+Rect MapSnapshot::GetChunkReach(int32_t cx, int32_t cy) const
+{
+	// objects are bucketed by their top-left node
+	int32_t size = 1 << ObjectGrid::ChunkShift;
+	return Rect::FromXYWH(cx << ObjectGrid::ChunkShift, cy << ObjectGrid::ChunkShift, size + mMaxObjectSize - 1, size + mMaxObjectSize - 1);
+}
+
+const MapObjectState* MapSnapshot::GetObject(const MapObjectHandle& handle) const
+{
+	if (handle.mIndex >= mObjectSlots.size())
+		return nullptr;
+	const ObjectSlot& slot = mObjectSlots[handle.mIndex];
+	if (slot.mChunk >= mObjectChunks.size())
+		return nullptr;
+	// slot of an unlinked object still points to where it was, something else may be there now
+	const std::vector<MapObjectState>& objects = mObjectChunks[slot.mChunk].mObjects;
+	if (slot.mIndex >= objects.size() || objects[slot.mIndex].mHandle != handle)
+		return nullptr;
+	return &objects[slot.mIndex];
+}
+
+MapObjectState* MapSnapshot::GetObject(const MapObjectHandle& handle)
+{
+	return const_cast<MapObjectState*>(static_cast<const MapSnapshot*>(this)->GetObject(handle));
+}
+
+/////////
+
+MapSnapshotBuffer::MapSnapshotBuffer()
+{
+	SDL_AtomicSet(&mMiddle, 2);
+	SDL_AtomicSet(&mAcquired, 0);
+}
+
+MapSnapshot& MapSnapshotBuffer::GetBack()
+{
+	return mSnapshots[mBack];
+}
+
+void MapSnapshotBuffer::Publish()
+{
+	mSnapshots[mBack].mSequence = ++mPublished;
+	// back becomes middle. what was in the middle is either stale or was never taken, both are free to overwrite
+	mBack = SDL_AtomicSet(&mMiddle, int(mBack) | NewFlag) & IndexMask;
+}
+
+bool MapSnapshotBuffer::IsAcknowledged()
+{
+	return mPublished && uint32_t(SDL_AtomicGet(&mAcquired)) == mPublished;
+}
+
+const MapSnapshot* MapSnapshotBuffer::Acquire()
+{
+	if (SDL_AtomicGet(&mMiddle) & NewFlag)
+	{
+		mFront = SDL_AtomicSet(&mMiddle, int(mFront)) & IndexMask;
+		SDL_AtomicSet(&mAcquired, int(mSnapshots[mFront].mSequence));
+	}
+	return mSnapshots[mFront].mSequence ? &mSnapshots[mFront] : nullptr;
+}
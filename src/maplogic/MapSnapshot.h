@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <SDL.h>
+#include "MapObject.h"
+#include "MapLight.h"
+#include "../screen/Color.h"
+#include "../screen/Rect.h"
+
+// render state of one object, captured by the simulation after it changes. the renderer never touches MapObject itself
+struct MapObjectState
+{
+	MapObjectHandle mHandle;
+	Rect mPosition;
+	// draws the object from this state only, nullptr if it isn't drawn
+	void (*mDraw)(MapView* view, const MapObjectState& state);
+	// meaning depends on mDraw: template of the object, animation frame, terrain height under it
+	const void* mClass;
+	uint32_t mFrame;
+	int32_t mHeight;
+};
+
+// what changed since the last snapshot the renderer took. may repeat changes it has seen already
+struct MapSnapshotChanges
+{
+	// past this many entries everything is considered changed
+	static const size_t MaxSize = 65536;
+
+	// everything changed: the view was just attached, or didn't take snapshots for a long time
+	bool mAll = false;
+	// terrain nodes to redraw, y * width + x
+	std::vector<uint32_t> mNodes;
+	// heights changed
+	std::vector<Rect> mShade;
+	// dynamic lights changed
+	std::vector<Rect> mLight;
+	// objects that look different
+	std::vector<MapObjectHandle> mObjects;
+
+	void Append(const MapSnapshotChanges& other);
+	void Clear();
+};
+
+// state of the map after a tick, everything the renderer reads. parts that rarely change carry a version and are
+// only copied into the snapshot when it differs
+struct MapSnapshot
+{
+	static const uint32_t NoObject = 0xFFFFFFFF;
+
+	// publish number in its buffer, 0 if never published
+	uint32_t mSequence = 0;
+	uint32_t mTick = 0;
+
+	// node arrays, width * height elements each
+	std::vector<uint16_t> mTiles;
+	std::vector<int8_t> mHeights;
+	uint32_t mHeightsVersion = 0;
+	// flags are copied by rows, only those with a different version
+	std::vector<uint16_t> mFlags;
+	std::vector<uint32_t> mFlagRows;
+	std::vector<MapLight> mLights;
+	uint32_t mLightsVersion = 0;
+
+	// global lighting from time of day
+	Color mLightTint = Color(255, 255, 255, 255);
+	uint16_t mLightBrightness = 255;
+	uint16_t mLightContrast = 255;
+
+	// linked objects by ObjectGrid chunk. a chunk is copied into the snapshot only when it was captured again since
+	struct ObjectChunk
+	{
+		std::vector<MapObjectState> mObjects;
+		// same as in ObjectGrid, changes when objects are linked into or unlinked from the chunk
+		uint32_t mVersion = 0;
+		// changes every time the chunk is captured, also when only looks of its objects changed
+		uint32_t mCaptured = 0;
+	};
+	uint32_t mObjectsVersion = 0;
+	std::vector<ObjectChunk> mObjectChunks;
+	uint32_t mChunksWidth = 0;
+	int32_t mMaxObjectSize = 1;
+	// where objects are by handle slot, mChunk is NoObject if never linked. may be stale after the object moved, GetObject checks it
+	struct ObjectSlot
+	{
+		uint32_t mChunk = NoObject;
+		uint32_t mIndex = 0;
+	};
+	std::vector<ObjectSlot> mObjectSlots;
+
+	MapSnapshotChanges mChanges;
+
+	// same as in ObjectGrid
+	Rect GetChunkRect(const Rect& rect) const;
+	uint32_t GetChunkVersion(int32_t cx, int32_t cy) const;
+	void QueryRect(const Rect& rect, std::vector<MapObjectHandle>& out) const;
+	// objects of one chunk that overlap the rect
+	void QueryChunk(int32_t cx, int32_t cy, const Rect& rect, std::vector<MapObjectHandle>& out) const;
+	// nodes that objects of the chunk may overlap
+	Rect GetChunkReach(int32_t cx, int32_t cy) const;
+	// nullptr if the object was deleted or unlinked
+	const MapObjectState* GetObject(const MapObjectHandle& handle) const;
+	MapObjectState* GetObject(const MapObjectHandle& handle);
+};
+
+// triple buffer between the simulation and one view. the simulation fills the back snapshot and publishes it,
+// the view takes the newest published one. neither side ever waits for the other
+class MapSnapshotBuffer
+{
+public:
+	MapSnapshotBuffer();
+
+	// simulation side
+	MapSnapshot& GetBack();
+	void Publish();
+	// true if the view took the last published snapshot
+	bool IsAcknowledged();
+
+	// render side. returns the newest snapshot, which stays valid until the next call. nullptr until the first publish
+	const MapSnapshot* Acquire();
+
+private:
+	static const int NewFlag = 4;
+	static const int IndexMask = 3;
+
+	MapSnapshot mSnapshots[3];
+	uint32_t mBack = 0;
+	uint32_t mFront = 1;
+	uint32_t mPublished = 0;
+	// index of the middle snapshot, with NewFlag if it was published and not taken yet
+	SDL_atomic_t mMiddle;
+	// sequence of the snapshot the view took last
+	SDL_atomic_t mAcquired;
+};
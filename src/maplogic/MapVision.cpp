@@ -0,0 +1,237 @@
+#include "MapVision.h"
+#include "MapLogic.h"
+#include <algorithm>
+#include <cmath>
+
+const int32_t MapVision::MaxRadius;
+const int32_t MapVision::EyeHeight;
+
+void MapVision::SetLogic(MapLogic* logic)
+{
+	mLogic = logic;
+	mWidth = logic->GetWidth();
+	mHeight = logic->GetHeight();
+	mRefs.assign(mWidth * mHeight, 0);
+	mSources.clear();
+	mFreeSources.clear();
+}
+
+const int32_t* MapVision::GetSpans(int32_t radius)
+{
+	// built once, on first use
+	static struct Spans
+	{
+		std::vector<int32_t> mData[MaxRadius + 1];
+		Spans()
+		{
+			for (int32_t r = 0; r <= MaxRadius; r++)
+			{
+				mData[r].resize(r * 2 + 1);
+				for (int32_t dy = -r; dy <= r; dy++)
+					mData[r][dy + r] = int32_t(sqrtf(float(r * r + r - dy * dy)));
+			}
+		}
+	} spans;
+
+	return spans.mData[radius].data();
+}
+
+uint32_t MapVision::AddSource(int32_t x, int32_t y, int32_t radius, bool lineOfSight)
+{
+	Source source;
+	source.mX = x;
+	source.mY = y;
+	source.mRadius = std::max(0, std::min(MaxRadius, radius));
+	source.mIsActive = true;
+	source.mLineOfSight = lineOfSight;
+
+	uint32_t id;
+	if (!mFreeSources.empty())
+	{
+		id = mFreeSources.back();
+		mFreeSources.pop_back();
+		mSources[id] = source;
+	}
+	else
+	{
+		id = mSources.size();
+		mSources.push_back(source);
+	}
+
+	if (lineOfSight)
+	{
+		Retrace(mSources[id], x, y);
+		return id;
+	}
+
+	const int32_t* spans = GetSpans(source.mRadius);
+	for (int32_t dy = -source.mRadius; dy <= source.mRadius; dy++)
+	{
+		int32_t hw = spans[dy + source.mRadius];
+		StampRow(y + dy, x - hw, x + hw + 1, 1);
+	}
+
+	return id;
+}
+
+void MapVision::MoveSource(uint32_t id, int32_t x, int32_t y)
+{
+	if (id >= mSources.size() || !mSources[id].mIsActive)
+		return;
+	Source& source = mSources[id];
+	if (source.mX == x && source.mY == y)
+		return;
+
+	if (source.mLineOfSight)
+	{
+		Retrace(source, x, y);
+		return;
+	}
+
+	// symmetric difference of old and new circle, row by row.
+	// new nodes are added first, so that nodes in both circles never drop to zero
+	int32_t r = source.mRadius;
+	const int32_t* spans = GetSpans(r);
+	int32_t y1 = std::min(source.mY, y) - r;
+	int32_t y2 = std::max(source.mY, y) + r;
+	for (int32_t row = y1; row <= y2; row++)
+	{
+		int32_t oldDY = row - source.mY;
+		int32_t newDY = row - y;
+		int32_t oldX1 = 0, oldX2 = 0, newX1 = 0, newX2 = 0;
+		if (oldDY >= -r && oldDY <= r)
+		{
+			oldX1 = source.mX - spans[oldDY + r];
+			oldX2 = source.mX + spans[oldDY + r] + 1;
+		}
+		if (newDY >= -r && newDY <= r)
+		{
+			newX1 = x - spans[newDY + r];
+			newX2 = x + spans[newDY + r] + 1;
+		}
+		StampRow(row, newX1, newX2, oldX1, oldX2, 1);
+		StampRow(row, oldX1, oldX2, newX1, newX2, -1);
+	}
+
+	source.mX = x;
+	source.mY = y;
+}
+
+void MapVision::RemoveSource(uint32_t id)
+{
+	if (id >= mSources.size() || !mSources[id].mIsActive)
+		return;
+	Source& source = mSources[id];
+	if (source.mLineOfSight)
+	{
+		for (uint32_t index : source.mVisible)
+			StampNode(index, -1);
+		source.mVisible.clear();
+	}
+	else
+	{
+		const int32_t* spans = GetSpans(source.mRadius);
+		for (int32_t dy = -source.mRadius; dy <= source.mRadius; dy++)
+		{
+			int32_t hw = spans[dy + source.mRadius];
+			StampRow(source.mY + dy, source.mX - hw, source.mX + hw + 1, -1);
+		}
+	}
+	source.mIsActive = false;
+	mFreeSources.push_back(id);
+}
+
+void MapVision::UpdateArea(const Rect& rect)
+{
+	for (auto& source : mSources)
+	{
+		if (!source.mIsActive || !source.mLineOfSight)
+			continue;
+		Rect bounds = Rect::FromLTRB(source.mX - source.mRadius, source.mY - source.mRadius, source.mX + source.mRadius + 1, source.mY + source.mRadius + 1);
+		Rect overlap = bounds.GetIntersection(rect);
+		if (overlap.w > 0 && overlap.h > 0)
+			Retrace(source, source.mX, source.mY);
+	}
+}
+
+void MapVision::Retrace(Source& source, int32_t x, int32_t y)
+{
+	// new nodes are added first, so that nodes seen from both positions never drop to zero
+	mTraced.clear();
+	mLOS.Trace(mLogic, x, y, source.mRadius, EyeHeight, mTraced);
+	for (uint32_t index : mTraced)
+		StampNode(index, 1);
+	for (uint32_t index : source.mVisible)
+		StampNode(index, -1);
+	source.mVisible.swap(mTraced);
+	source.mX = x;
+	source.mY = y;
+}
+
+void MapVision::StampNode(uint32_t index, int32_t delta)
+{
+	uint16_t& flags = mLogic->GetFlags()[index];
+	if (delta > 0)
+	{
+		if (!mRefs[index]++)
+		{
+			flags |= MapNode::Discovered | MapNode::Visible;
+			mLogic->InvalidateFlags(index / mWidth);
+		}
+	}
+	else
+	{
+		if (!--mRefs[index])
+		{
+			flags &= ~MapNode::Visible;
+			mLogic->InvalidateFlags(index / mWidth);
+		}
+	}
+}
+
+void MapVision::StampRow(int32_t y, int32_t x1, int32_t x2, int32_t cut1, int32_t cut2, int32_t delta)
+{
+	if (cut1 >= cut2)
+	{
+		StampRow(y, x1, x2, delta);
+		return;
+	}
+	StampRow(y, x1, std::min(x2, cut1), delta);
+	StampRow(y, std::max(x1, cut2), x2, delta);
+}
+
+void MapVision::StampRow(int32_t y, int32_t x1, int32_t x2, int32_t delta)
+{
+	if (y < 0 || y >= mHeight)
+		return;
+	x1 = std::max(x1, 0);
+	x2 = std::min(x2, mWidth);
+	if (x1 >= x2)
+		return;
+
+	// fog of war is applied over the screen from node flags, so terrain does not need redraw here
+	uint16_t* refs = mRefs.data() + y * mWidth;
+	uint16_t* flags = mLogic->GetFlags() + y * mWidth;
+	bool changed = false;
+	for (int32_t x = x1; x < x2; x++)
+	{
+		if (delta > 0)
+		{
+			if (!refs[x]++)
+			{
+				flags[x] |= MapNode::Discovered | MapNode::Visible;
+				changed = true;
+			}
+		}
+		else
+		{
+			if (!--refs[x])
+			{
+				flags[x] &= ~MapNode::Visible;
+				changed = true;
+			}
+		}
+	}
+	if (changed)
+		mLogic->InvalidateFlags(y);
+}
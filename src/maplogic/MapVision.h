@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "LineOfSight.h"
+#include "../screen/Rect.h"
+
+class MapLogic;
+
+// vision sources stamp circles into per-node reference counts.
+// a node is Visible while any source covers it, moving a source only touches nodes that entered or left its circle.
+// line of sight sources stamp the nodes traced by LineOfSight instead of the whole circle
+class MapVision
+{
+public:
+
+	// circles are precalculated for every radius up to this
+	static const int32_t MaxRadius = 32;
+	// height of the eye above the node for line of sight sources
+	static const int32_t EyeHeight = 16;
+
+	void SetLogic(MapLogic* logic);
+
+	uint32_t AddSource(int32_t x, int32_t y, int32_t radius, bool lineOfSight);
+	void MoveSource(uint32_t id, int32_t x, int32_t y);
+	void RemoveSource(uint32_t id);
+	// retraces line of sight sources that can see the rect, after heights there have changed
+	void UpdateArea(const Rect& rect);
+
+private:
+
+	struct Source
+	{
+		int32_t mX;
+		int32_t mY;
+		int32_t mRadius;
+		bool mIsActive;
+		bool mLineOfSight;
+		// stamped nodes of a line of sight source
+		std::vector<uint32_t> mVisible;
+	};
+
+	// half width of every circle row, 2r+1 values
+	static const int32_t* GetSpans(int32_t radius);
+	// adds delta to [x1, x2) of row y, minus [cut1, cut2)
+	void StampRow(int32_t y, int32_t x1, int32_t x2, int32_t cut1, int32_t cut2, int32_t delta);
+	void StampRow(int32_t y, int32_t x1, int32_t x2, int32_t delta);
+	void StampNode(uint32_t index, int32_t delta);
+	void Retrace(Source& source, int32_t x, int32_t y);
+
+	MapLogic* mLogic = nullptr;
+	int32_t mWidth = 0;
+	int32_t mHeight = 0;
+
+	std::vector<uint16_t> mRefs;
+	std::vector<Source> mSources;
+	std::vector<uint32_t> mFreeSources;
+	LineOfSight mLOS;
+	std::vector<uint32_t> mTraced;
+
+};
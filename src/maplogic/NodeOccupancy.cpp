@@ -0,0 +1,87 @@
+#include "NodeOccupancy.h"
+
+const uint32_t NodeOccupancy::None;
+
+void NodeOccupancy::SetSize(uint32_t w, uint32_t h)
+{
+	mHeads.assign(w * h, None);
+	mLinks.clear();
+	mFreeLinks = None;
+	mLinkCount = 0;
+}
+
+uint32_t NodeOccupancy::AllocateLink()
+{
+	if (mFreeLinks == None)
+	{
+		// grow the pool. vector doubles, so this stops happening once the peak is reached
+		uint32_t first = mLinks.size();
+		uint32_t count = first ? first : 1024;
+		mLinks.resize(first + count);
+		for (uint32_t i = first; i < first + count; i++)
+			mLinks[i].mNextOfObject = (i + 1 < first + count) ? i + 1 : None;
+		mFreeLinks = first;
+	}
+
+	uint32_t link = mFreeLinks;
+	mFreeLinks = mLinks[link].mNextOfObject;
+	mLinkCount++;
+	return link;
+}
+
+void NodeOccupancy::Link(MapObject* object, uint32_t node, uint32_t& objectLinks)
+{
+	uint32_t link = AllocateLink();
+	Entry& l = mLinks[link];
+	l.mObject = object;
+	l.mNode = node;
+	l.mPrev = None;
+	l.mNext = mHeads[node];
+	if (l.mNext != None)
+		mLinks[l.mNext].mPrev = link;
+	mHeads[node] = link;
+	l.mNextOfObject = objectLinks;
+	objectLinks = link;
+}
+
+void NodeOccupancy::UnlinkAll(uint32_t& objectLinks)
+{
+	uint32_t link = objectLinks;
+	while (link != None)
+	{
+		Entry& l = mLinks[link];
+		uint32_t next = l.mNextOfObject;
+
+		if (l.mPrev != None)
+			mLinks[l.mPrev].mNext = l.mNext;
+		else mHeads[l.mNode] = l.mNext;
+		if (l.mNext != None)
+			mLinks[l.mNext].mPrev = l.mPrev;
+
+		l.mObject = nullptr;
+		l.mNextOfObject = mFreeLinks;
+		mFreeLinks = link;
+		mLinkCount--;
+
+		link = next;
+	}
+	objectLinks = None;
+}
+
+NodeOccupancy::Range NodeOccupancy::GetObjects(uint32_t node) const
+{
+	Range range;
+	range.mLinks = mLinks.data();
+	range.mFirst = (node < mHeads.size()) ? mHeads[node] : None;
+	return range;
+}
+
+uint32_t NodeOccupancy::GetLinkCount() const
+{
+	return mLinkCount;
+}
+
+uint32_t NodeOccupancy::GetPoolSize() const
+{
+	return mLinks.size();
+}
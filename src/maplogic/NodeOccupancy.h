@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class MapObject;
+
+// objects occupying map nodes.
+// every link is in two intrusive lists: doubly linked list of the node (O(1) unlink), and singly linked list of the object.
+// links are pooled and reused through a free list, so linking and unlinking don't allocate once the pool has grown
+class NodeOccupancy
+{
+public:
+
+	static const uint32_t None = 0xFFFFFFFF;
+
+	struct Entry
+	{
+		MapObject* mObject;
+		uint32_t mNode;
+		// objects of the node
+		uint32_t mPrev;
+		uint32_t mNext;
+		// nodes of the object, also used as free list
+		uint32_t mNextOfObject;
+	};
+
+	// range-for over objects of a node
+	class Iterator
+	{
+	public:
+		Iterator(const Entry* links, uint32_t link) : mLinks(links), mLink(link) {}
+		MapObject* operator*() const { return mLinks[mLink].mObject; }
+		Iterator& operator++() { mLink = mLinks[mLink].mNext; return *this; }
+		bool operator!=(const Iterator& other) const { return mLink != other.mLink; }
+	private:
+		const Entry* mLinks;
+		uint32_t mLink;
+	};
+
+	struct Range
+	{
+		const Entry* mLinks;
+		uint32_t mFirst;
+		Iterator begin() const { return Iterator(mLinks, mFirst); }
+		Iterator end() const { return Iterator(mLinks, None); }
+		bool IsEmpty() const { return mFirst == None; }
+	};
+
+	void SetSize(uint32_t w, uint32_t h);
+
+	// objectLinks is the head of the object's own list, None for an object that is not linked
+	void Link(MapObject* object, uint32_t node, uint32_t& objectLinks);
+	void UnlinkAll(uint32_t& objectLinks);
+
+	Range GetObjects(uint32_t node) const;
+
+	// links in use and allocated
+	uint32_t GetLinkCount() const;
+	uint32_t GetPoolSize() const;
+
+private:
+
+	uint32_t AllocateLink();
+
+	std::vector<uint32_t> mHeads;
+	std::vector<Entry> mLinks;
+	uint32_t mFreeLinks = None;
+	uint32_t mLinkCount = 0;
+
+};
@@ -0,0 +1,97 @@
+#include "ObjectGrid.h"
+#include "MapObject.h"
+#include <algorithm>
+
+const uint32_t ObjectGrid::ChunkShift;
+
+void ObjectGrid::SetSize(uint32_t w, uint32_t h)
+{
+	mChunksWidth = (w + (1 << ChunkShift) - 1) >> ChunkShift;
+	mChunksHeight = (h + (1 << ChunkShift) - 1) >> ChunkShift;
+	mChunks.clear();
+	mChunks.resize(mChunksWidth * mChunksHeight);
+	mMaxObjectSize = 1;
+}
+
+void ObjectGrid::Insert(MapObject* obj)
+{
+	const Rect& pos = obj->GetPosition();
+	uint32_t chunkIndex = (pos.y >> ChunkShift) * mChunksWidth + (pos.x >> ChunkShift);
+	Chunk& chunk = mChunks[chunkIndex];
+	obj->mGridChunk = chunkIndex;
+	obj->mGridIndex = chunk.mObjects.size();
+	chunk.mObjects.push_back(obj);
+	chunk.mVersion++;
+	mMaxObjectSize = std::max(mMaxObjectSize, std::max(pos.w, pos.h));
+}
+
+void ObjectGrid::Remove(MapObject* obj)
+{
+	Chunk& chunk = mChunks[obj->mGridChunk];
+	MapObject* last = chunk.mObjects.back();
+	chunk.mObjects[obj->mGridIndex] = last;
+	last->mGridIndex = obj->mGridIndex;
+	chunk.mObjects.pop_back();
+	chunk.mVersion++;
+}
+
+Rect ObjectGrid::GetChunkRect(const Rect& rect) const
+{
+	// objects are stored by top-left node, so objects starting up to max size before the rect may overlap it
+	int32_t left = std::max(0, rect.GetLeft() - mMaxObjectSize + 1) >> ChunkShift;
+	int32_t top = std::max(0, rect.GetTop() - mMaxObjectSize + 1) >> ChunkShift;
+	int32_t right = std::min(int32_t(mChunksWidth), ((rect.GetRight() - 1) >> ChunkShift) + 1);
+	int32_t bottom = std::min(int32_t(mChunksHeight), ((rect.GetBottom() - 1) >> ChunkShift) + 1);
+	return Rect::FromLTRB(left, top, right, bottom);
+}
+
+const std::vector<MapObject*>& ObjectGrid::GetChunkObjects(int32_t cx, int32_t cy) const
+{
+	return mChunks[cy * mChunksWidth + cx].mObjects;
+}
+
+uint32_t ObjectGrid::GetChunkVersion(int32_t cx, int32_t cy) const
+{
+	return mChunks[cy * mChunksWidth + cx].mVersion;
+}
+
+void ObjectGrid::QueryRect(const Rect& rect, std::vector<MapObject*>& out) const
+{
+	if (rect.w <= 0 || rect.h <= 0)
+		return;
+	Rect chunkRect = GetChunkRect(rect);
+	for (int32_t cy = chunkRect.GetTop(); cy < chunkRect.GetBottom(); cy++)
+	{
+		for (int32_t cx = chunkRect.GetLeft(); cx < chunkRect.GetRight(); cx++)
+		{
+			for (MapObject* obj : GetChunkObjects(cx, cy))
+			{
+				const Rect& pos = obj->GetPosition();
+				if (pos.GetLeft() < rect.GetRight() && pos.GetRight() > rect.GetLeft() &&
+					pos.GetTop() < rect.GetBottom() && pos.GetBottom() > rect.GetTop())
+					out.push_back(obj);
+			}
+		}
+	}
+}
+
+void ObjectGrid::QueryRadius(int32_t x, int32_t y, int32_t radius, std::vector<MapObject*>& out) const
+{
+	Rect rect = Rect::FromLTRB(x - radius, y - radius, x + radius + 1, y + radius + 1);
+	Rect chunkRect = GetChunkRect(rect);
+	for (int32_t cy = chunkRect.GetTop(); cy < chunkRect.GetBottom(); cy++)
+	{
+		for (int32_t cx = chunkRect.GetLeft(); cx < chunkRect.GetRight(); cx++)
+		{
+			for (MapObject* obj : GetChunkObjects(cx, cy))
+			{
+				// closest node of the object to the center
+				const Rect& pos = obj->GetPosition();
+				int32_t dx = x - std::max(pos.GetLeft(), std::min(x, pos.GetRight() - 1));
+				int32_t dy = y - std::max(pos.GetTop(), std::min(y, pos.GetBottom() - 1));
+				if (dx * dx + dy * dy <= radius * radius)
+					out.push_back(obj);
+			}
+		}
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "../screen/Rect.h"
+
+class MapObject;
+
+// objects bucketed by chunks of 16x16 nodes, by the node of their top-left corner.
+// queries pad the rect by the largest object size seen, so every object is found exactly once, without dedup
+class ObjectGrid
+{
+public:
+
+	static const uint32_t ChunkShift = 4;
+
+	void SetSize(uint32_t w, uint32_t h);
+
+	void Insert(MapObject* obj);
+	void Remove(MapObject* obj);
+
+	// objects overlapping the rect (in nodes)
+	void QueryRect(const Rect& rect, std::vector<MapObject*>& out) const;
+	// objects overlapping the circle around node x,y
+	void QueryRadius(int32_t x, int32_t y, int32_t radius, std::vector<MapObject*>& out) const;
+
+	// chunks that may hold objects overlapping the rect
+	Rect GetChunkRect(const Rect& rect) const;
+	const std::vector<MapObject*>& GetChunkObjects(int32_t cx, int32_t cy) const;
+	// changes every time an object is inserted into or removed from the chunk
+	uint32_t GetChunkVersion(int32_t cx, int32_t cy) const;
+	uint32_t GetChunksWidth() const { return mChunksWidth; }
+	uint32_t GetChunksHeight() const { return mChunksHeight; }
+	// queries reach this many nodes back from the rect
+	int32_t GetMaxObjectSize() const { return mMaxObjectSize; }
+
+private:
+
+	struct Chunk
+	{
+		std::vector<MapObject*> mObjects;
+		uint32_t mVersion = 0;
+	};
+
+	uint32_t mChunksWidth = 0;
+	uint32_t mChunksHeight = 0;
+	int32_t mMaxObjectSize = 1;
+	std::vector<Chunk> mChunks;
+
+};
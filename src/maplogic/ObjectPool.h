@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <new>
+
+// storage for map objects of one class.
+// objects are placed one after another in large blocks, freed slots are reused. blocks are only released with the pool
+class ObjectPoolBase
+{
+public:
+
+	virtual ~ObjectPoolBase() {}
+	virtual void Free(void* p) = 0;
+
+};
+
+template<typename T>
+class ObjectPool : public ObjectPoolBase
+{
+public:
+
+	static const uint32_t BlockSize = 1024;
+
+	virtual ~ObjectPool()
+	{
+		for (auto& block : mBlocks)
+			::operator delete(block);
+	}
+
+	void* Allocate()
+	{
+		if (!mFree.empty())
+		{
+			void* p = mFree.back();
+			mFree.pop_back();
+			return p;
+		}
+
+		if (mBlocks.empty() || mBlockUsed == BlockSize)
+		{
+			mBlocks.push_back(::operator new(sizeof(T) * BlockSize));
+			mBlockUsed = 0;
+		}
+
+		return static_cast<char*>(mBlocks.back()) + sizeof(T) * mBlockUsed++;
+	}
+
+	virtual void Free(void* p)
+	{
+		mFree.push_back(p);
+	}
+
+private:
+
+	std::vector<void*> mBlocks;
+	uint32_t mBlockUsed = 0;
+	std::vector<void*> mFree;
+
+};
@@ -0,0 +1,83 @@
+#include "TimeOfDay.h"
+#include <algorithm>
+#include <cmath>
+
+const uint32_t TimeOfDay::TicksPerHour;
+const uint32_t TimeOfDay::TicksPerDay;
+
+TimeOfDay::TimeOfDay()
+{
+	mTime = TicksPerHour * 12;
+	mDarkness = 0;
+	mContrast = 255;
+	mTint = Color(255, 255, 255, 255);
+	mBrightness = 255;
+}
+
+void TimeOfDay::SetFromMap(uint32_t hour, uint32_t darkness, uint32_t contrast)
+{
+	mDarkness = std::min(darkness, uint32_t(192)); // night is never black
+	mContrast = contrast ? std::max(uint32_t(128), std::min(contrast, uint32_t(510))) : 255;
+	mTime = (hour % 24) * TicksPerHour;
+	UpdateLighting();
+}
+
+bool TimeOfDay::Advance(uint32_t ticks)
+{
+	return SetTime(mTime + ticks);
+}
+
+bool TimeOfDay::SetTime(uint32_t time)
+{
+	mTime = time % TicksPerDay;
+	return UpdateLighting();
+}
+
+uint32_t TimeOfDay::GetTime() const
+{
+	return mTime;
+}
+
+Color TimeOfDay::GetTint() const
+{
+	return mTint;
+}
+
+uint16_t TimeOfDay::GetBrightness() const
+{
+	return mBrightness;
+}
+
+uint16_t TimeOfDay::GetContrast() const
+{
+	return mContrast;
+}
+
+// rounds to a multiple of step, 255 stays 255
+static uint8_t Quantize(float value, int32_t step)
+{
+	int32_t v = (int32_t(value + 0.5f) + step / 2) / step * step;
+	return uint8_t(std::max(0, std::min(255, v)));
+}
+
+bool TimeOfDay::UpdateLighting()
+{
+	// sun height is -1 at midnight and 1 at noon. twilight is where it crosses the horizon
+	float sun = -std::cos(float(mTime) / TicksPerDay * 6.2831853f);
+	float day = std::max(0.0f, std::min(1.0f, (sun + 0.25f) * 2));
+	float twilight = std::max(0.0f, 1.0f - std::fabs(sun) / 0.35f);
+	// everything scales with darkness, so maps without darkness are neutral all day
+	float night = (1 - day) * mDarkness / 255;
+	float dusk = twilight * mDarkness / 192;
+
+	uint16_t brightness = Quantize(255 - mDarkness * (1 - day), 4);
+	Color tint(Quantize(255 - 64 * night, 8),
+		Quantize(255 - 40 * dusk - 48 * night, 8),
+		Quantize(255 - 96 * dusk, 8), 255);
+
+	if (brightness == mBrightness && tint == mTint)
+		return false;
+	mBrightness = brightness;
+	mTint = tint;
+	return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include "../screen/Color.h"
+
+// global lighting over the day. time is counted in fixed ticks from midnight.
+// the map sets the starting hour and how dark the night gets, lighting is derived from sun height
+class TimeOfDay
+{
+public:
+
+	// one game hour per real minute at normal speed (30 ticks per second)
+	static const uint32_t TicksPerHour = 1800;
+	static const uint32_t TicksPerDay = TicksPerHour * 24;
+
+	TimeOfDay();
+
+	// values from ALM header: starting hour (0 - 23), night darkness and contrast (0 - 255, 0 is neutral)
+	void SetFromMap(uint32_t hour, uint32_t darkness, uint32_t contrast);
+	// returns true if lighting changed
+	bool Advance(uint32_t ticks = 1);
+	bool SetTime(uint32_t time);
+	uint32_t GetTime() const;
+
+	// lighting is quantized, so that it doesn't change every tick
+	Color GetTint() const;
+	uint16_t GetBrightness() const;
+	uint16_t GetContrast() const;
+
+private:
+
+	bool UpdateLighting();
+
+	uint32_t mTime;
+	uint32_t mDarkness;
+	uint16_t mContrast;
+
+	Color mTint;
+	uint16_t mBrightness;
+
+};
@@ -2,27 +2,41 @@
 
 #include <vector>
 #include "../screen/Color.h"
+#include "PaletteRegistry.h"
 
-// this class provides generating 33 versions of a palette for light/shadow with the specified tint
-// 0-15: dark
-// 16: normal
-// 17-33: light
+// this class provides 65 versions of a palette for light/shadow with the specified tint, see PaletteTable.
+// colors live in tables shared through PaletteRegistry, so equal palettes with equal lighting are generated once
 class CompoundPalette
 {
 public:
 
+	CompoundPalette() {}
+	CompoundPalette(const CompoundPalette&) = delete;
+	CompoundPalette& operator=(const CompoundPalette&) = delete;
+	~CompoundPalette();
+
 	void SetBasePalette(const Color* basePalette);
-	// brightness, contrast are from 0 to 255 (or larger) where 255 is normal
+	const Color* GetBasePalette() const;
+	uint64_t GetHash() const;
+	// brightness, contrast are from 0 to 255 (or larger) where 255 is normal. switches to new colors right away
 	void UpdatePalettes(Color tint, uint16_t brightness, uint16_t contrast);
+	// same, but current colors stay until CommitPending. queued colors are double buffered with current ones
+	void QueuePalettes(Color tint, uint16_t brightness, uint16_t contrast);
+	// generates levels of queued colors that are in use by current ones, at most count of them (count is decreased).
+	// returns true when queued colors are ready, or nothing was queued
+	bool GeneratePending(uint32_t& count);
+	// switches to queued colors. pointers returned by GetPalette before are invalid after this
+	void CommitPending();
+	bool IsPending() const;
 	const Color* GetPalette(uint32_t index) const;
+	// level of queued colors, or of current ones if nothing is queued
+	const Color* GetPendingPalette(uint32_t index) const;
 
 private:
 
 	std::vector<Color> mBasePalette;
-	std::vector<Color> mGeneratedPalettes;
-
-	Color mLastTint;
-	uint16_t mLastBrightness;
-	uint16_t mLastContrast;
+	uint64_t mHash = 0;
+	PaletteTable* mTable = nullptr;
+	PaletteTable* mPending = nullptr;
 
-};
\ No newline at end of file
+};
@@ -1,8 +1,15 @@
 #include "MapView.h"
 #include "../Application.h"
+#include "../draw/Simd.h"
+#include "../Thread.h"
+#include "../maplogic/MapBenchmarks.h"
 #include <algorithm>
 #include <cmath>
 
+const int32_t MapView::BinHeight;
+const uint32_t MapView::WaterTicks;
+const uint32_t MapView::RepaintNodesPerFrame;
+
 MapView::MapView(UIElement* parent, MapLogic* logic) : LoadingElement(parent)
 {
 	if (parent == nullptr)
@@ -11,8 +18,8 @@ MapView::MapView(UIElement* parent, MapLogic* logic) : LoadingElement(parent)
 		Application::GetInstance()->Abort("Attempted to create MapView without MapLogic");
 	SetClientRect(parent->GetClientRect());
 	mLogic = logic;
-	mOwnLogic = false; // ticked externally
-	mLogic->AttachView(this);
+	mOwnLogic = false; // started externally
+	mLogic->AttachView(&mSnapshots);
 	SetDefaults();
 }
 
@@ -34,7 +41,10 @@ MapView::~MapView()
 
 	if (mLogic != nullptr)
 	{
-		mLogic->DetachView(this);
+		// messages posted by this view run before detach returns
+		if (mOwnLogic)
+			mLogic->Stop();
+		mLogic->DetachView(&mSnapshots);
 		if (mOwnLogic)
 			delete mLogic;
 	}
@@ -50,8 +60,9 @@ void MapView::LoadingThread()
 	if (mOwnLogic)
 	{
 		mLogic = new MapLogic(mOwnMapPath);
-		mLogic->AttachView(this);
+		mLogic->AttachView(&mSnapshots);
 		SetDefaults();
+		mLogic->Start();
 	}
 	// load images
 	mTiles.resize(0x34);
@@ -62,13 +73,13 @@ void MapView::LoadingThread()
 		mTiles[i] = new ImagePaletted(Format("graphics/terrain/tile%d-%02d.bmp", tile1, tile2));
 	}
 	// load palettes
-	mTilePalettes.resize(4);
 	for (int i = 0; i < 4; i++)
 	{
 		ImagePaletted* imageWithBasePalette = mTiles[i << 4];
 		mTilePalettes[i].SetBasePalette(imageWithBasePalette->GetPalette());
-		mTilePalettes[i].UpdatePalettes(Color(255, 255, 255, 255), 255, 255);
+		mTilePalettes[i].UpdatePalettes(mLightTint, mLightBrightness, mLightContrast);
 	}
+	UpdateTerrainLookup();
 }
 
 void MapView::Tick()
@@ -86,10 +97,6 @@ void MapView::Tick()
 
 	Application::GetInstance()->GetMouse()->SetCursor(Mouse::Default);
 
-	// if own map logic, tick it
-	if (mOwnLogic && mLogic != nullptr)
-		mLogic->Tick();
-
 }
 
 bool MapView::HandleEvent(const SDL_Event* ev)
@@ -117,30 +124,98 @@ bool MapView::HandleEvent(const SDL_Event* ev)
 			{
 				DrawingContext ctx(mTerrain);
 				ctx.ClearRect(Rect::FromXYWH(0, 0, mTerrain->GetWidth(), mTerrain->GetHeight()), Color(0, 0, 0, 0));
+				memset(mTerrainIndexed->GetBuffer(), 0, mTerrainIndexed->GetWidth() * mTerrainIndexed->GetHeight() * sizeof(uint16_t));
+				ClearWater();
+				AddDamage(GetClipRect());
 				if (ev->key.keysym.mod & KMOD_SHIFT) // forces terrain redraw
 					mLastDrawnRect = mLastVisibleRect = Rect::FromXYWH(0, 0, 0, 0);
 				return true;
 			}
+#ifdef ALLODS_BENCHMARKS
+		case SDLK_b:
+			// compare binned and serial drawing of the next frame with shift
+			if (ev->key.keysym.mod & KMOD_SHIFT)
+			{
+				mVerifyBinnedDraw = true;
+				return true;
+			}
+			mBinnedDraw = !mBinnedDraw;
+			Printf("Object drawing: %s", mBinnedDraw ? "binned, parallel" : "serial");
+			return true;
+		case SDLK_l:
+			// place a light under cursor, or remove all lights with shift
+			if (ev->key.keysym.mod & KMOD_SHIFT)
+			{
+				mLogic->Post([](MapLogic* logic) {
+					logic->RemoveAllLights();
+				});
+			}
+			else if (mHoverX >= 0 && mHoverY >= 0)
+			{
+				int32_t x = mHoverX;
+				int32_t y = mHoverY;
+				mLogic->Post([x, y](MapLogic* logic) {
+					logic->AddLight(x, y, 6, 96);
+				});
+			}
+			return true;
+		case SDLK_h:
+			// raise (or lower with shift) terrain under cursor, tests incremental shading
+			if (mHoverX >= 0 && mHoverY >= 0)
+			{
+				int32_t x = mHoverX;
+				int32_t y = mHoverY;
+				int32_t delta = (ev->key.keysym.mod & KMOD_SHIFT) ? -8 : 8;
+				mLogic->Post([x, y, delta](MapLogic* logic) {
+					int32_t height = logic->GetHeights()[y * logic->GetWidth() + x] + delta;
+					logic->SetHeight(x, y, std::max(-128, std::min(127, height)));
+				});
+			}
+			return true;
+		case SDLK_p:
+			SetDeferredTerrain(!mDeferredTerrain);
+			return true;
+		case SDLK_f:
+			SetFusedFOW(!mFusedFOW);
+			return true;
+		case SDLK_v:
+			mLogic->Post(BenchmarkLineOfSight);
+			return true;
+		case SDLK_o:
+			mLogic->Post(BenchmarkOccupancy);
+			return true;
+		case SDLK_d:
+			mLogic->Post(BenchmarkObjects);
+			return true;
+		case SDLK_t:
+			// skip an hour forward (or back with shift)
+			{
+				uint32_t hour = (ev->key.keysym.mod & KMOD_SHIFT) ? TimeOfDay::TicksPerDay - TimeOfDay::TicksPerHour : TimeOfDay::TicksPerHour;
+				mLogic->Post([hour](MapLogic* logic) {
+					logic->SetTimeOfDay(logic->GetTimeOfDay() + hour);
+					Printf("Time of day: %02u:%02u", logic->GetTimeOfDay() / TimeOfDay::TicksPerHour, logic->GetTimeOfDay() % TimeOfDay::TicksPerHour * 60 / TimeOfDay::TicksPerHour);
+				});
+				return true;
+			}
+#endif
 		}
 	}
 	else if (ev->type == SDL_MOUSEMOTION)
 	{
 		mHoverX = -1;
 		mHoverY = -1;
-		if (ev->motion.x >= 0 && ev->motion.x < mTerrain->GetWidth() &&
+		if (mSnapshot != nullptr &&
+			ev->motion.x >= 0 && ev->motion.x < mTerrain->GetWidth() &&
 			ev->motion.y >= 0 && ev->motion.y < mTerrain->GetHeight())
 		{
 			float fX = float(ev->motion.x % 32) / 31;
 			int32_t cx = ev->motion.x / 32 + mScrollX;
 			int32_t cy = -1;
-			MapNode* nodes = mLogic->GetNodes() + cx + mVisibleRect.GetTop() * mLogic->GetWidth();
+			const int8_t* heights = mSnapshot->mHeights.data() + cx + mVisibleRect.GetTop() * mLogic->GetWidth();
 			for (int32_t i = mVisibleRect.GetTop(); i <= mVisibleRect.GetBottom(); i++)
 			{
-				MapNode* node1 = nodes;
-				MapNode* node2 = nodes + 1;
-				
-				int32_t y1 = (i - mScrollY) * 32 - node1->mHeight;
-				int32_t y2 = (i - mScrollY) * 32 - node2->mHeight;
+				int32_t y1 = (i - mScrollY) * 32 - *heights;
+				int32_t y2 = (i - mScrollY) * 32 - *(heights + 1);
 				int32_t y = y2 * fX + y1 * (1 - fX);
 				if (y > ev->motion.y)
 				{
@@ -148,57 +223,13 @@ bool MapView::HandleEvent(const SDL_Event* ev)
 					break;
 				}
 
-				nodes += mLogic->GetWidth();
+				heights += mLogic->GetWidth();
 			}
 
 			if (cx > 0 && cy > 0 && cx < mLogic->GetWidth() && cy < mLogic->GetHeight())
 			{
 				mHoverX = cx;
 				mHoverY = cy;
-
-				// set visible
-				MapNode* nodes = mLogic->GetNodes();
-				for (int y = 0; y < mLogic->GetHeight(); y++)
-				{
-					for (int x = 0; x < mLogic->GetWidth(); x++)
-					{
-
-						uint16_t flags = nodes->mFlags;
-						if (abs(x - cx) < 8 && abs(y - cy) < 8)
-						{
-							flags |= MapNode::Discovered | MapNode::Visible;
-						}
-						else
-						{
-							flags &= ~MapNode::Visible;
-						}
-						
-						if (flags != nodes->mFlags)
-						{
-							if ((flags & MapNode::Discovered) != (nodes->mFlags & MapNode::Discovered))
-								flags |= MapNode::NeedRedraw;
-							nodes->mFlags = flags | MapNode::NeedRedrawFOW;
-							int pitch = mLogic->GetWidth();
-							if (y > 0)
-							{
-								if (x > 0) (nodes - pitch - 1)->mFlags |= MapNode::NeedRedrawFOW;
-								(nodes - pitch)->mFlags |= MapNode::NeedRedrawFOW;
-								if (x+1 < pitch) (nodes - pitch + 1)->mFlags |= MapNode::NeedRedrawFOW;
-							}
-							(nodes - 1)->mFlags |= MapNode::NeedRedrawFOW;
-							(nodes + 1)->mFlags |= MapNode::NeedRedrawFOW;
-							if (y + 1 < mLogic->GetHeight())
-							{
-								if (x > 0) (nodes + pitch - 1)->mFlags |= MapNode::NeedRedrawFOW;
-								(nodes + pitch)->mFlags |= MapNode::NeedRedrawFOW;
-								if (x+1 < pitch) (nodes + pitch + 1)->mFlags |= MapNode::NeedRedrawFOW;
-							}
-						}
-
-						nodes++;
-
-					}
-				}
 			}
 			else
 			{
@@ -215,11 +246,18 @@ void MapView::SetDefaults()
 {
 	const Rect& clientRect = GetClientRect();
 	mTerrain = new ImageTruecolor(clientRect.w, clientRect.h);
-	mTerrainFOW = new ImagePaletted(mTerrain->GetWidth(), mTerrain->GetHeight());
+	mTerrainBack = new ImageTruecolor(clientRect.w, clientRect.h);
+	mTerrainIndexed = new ImageIndexed(clientRect.w, clientRect.h);
+	mTerrainLookup.resize(65536);
+	mTerrainIndexed->SetLookup(mTerrainLookup.data());
+	mWaterMask.assign(clientRect.w * clientRect.h, 0);
 	SetScroll(8, 8);
 	mTerrainShade.resize(mLogic->GetWidth() * mLogic->GetHeight());
 	mTerrainLight.resize(mLogic->GetWidth() * mLogic->GetHeight());
-	UpdateShade();
+	mFOWCells.assign(mLogic->GetWidth() * mLogic->GetHeight(), FOWBorder);
+	mDirtyNodes.SetSize(mLogic->GetWidth(), mLogic->GetHeight());
+	// shade and light are built when the first snapshot arrives
+	UpdateFOWLevels();
 }
 
 void MapView::SetScroll(int32_t x, int32_t y)
@@ -255,6 +293,75 @@ void MapView::UpdateVisibleRect()
 	mVisibleRect = viewRect;
 }
 
+void MapView::UpdateVisibleObjects()
+{
+	const MapSnapshot& grid = *mSnapshot;
+	Rect chunkRect = grid.GetChunkRect(mVisibleRect);
+
+	// chunks that stay in view are carried over by position, chunks that left are dropped with the old list
+	bool moved = (chunkRect != mVisibleChunks);
+	bool changed = false;
+	if (moved)
+	{
+		mVisibleObjectsTemp.resize(std::max(0, chunkRect.w * chunkRect.h));
+		for (int32_t cy = chunkRect.GetTop(); cy < chunkRect.GetBottom(); cy++)
+		{
+			for (int32_t cx = chunkRect.GetLeft(); cx < chunkRect.GetRight(); cx++)
+			{
+				VisibleChunk& chunk = mVisibleObjectsTemp[(cy - chunkRect.y) * chunkRect.w + (cx - chunkRect.x)];
+				if (mVisibleChunks.Contains(Point(cx, cy)))
+					std::swap(chunk, mVisibleObjects[(cy - mVisibleChunks.y) * mVisibleChunks.w + (cx - mVisibleChunks.x)]);
+				else
+				{
+					// nothing listed yet, the chunk is queried below
+					chunk.mObjects.clear();
+					chunk.mVersion = 0;
+					chunk.mQuery = Rect::FromXYWH(0, 0, 0, 0);
+				}
+			}
+		}
+
+		for (int32_t cy = mVisibleChunks.GetTop(); cy < mVisibleChunks.GetBottom() && !changed; cy++)
+		{
+			for (int32_t cx = mVisibleChunks.GetLeft(); cx < mVisibleChunks.GetRight(); cx++)
+			{
+				if (!chunkRect.Contains(Point(cx, cy)) && !mVisibleObjects[(cy - mVisibleChunks.y) * mVisibleChunks.w + (cx - mVisibleChunks.x)].mObjects.empty())
+				{
+					changed = true;
+					break;
+				}
+			}
+		}
+
+		mVisibleObjects.swap(mVisibleObjectsTemp);
+		mVisibleChunks = chunkRect;
+	}
+
+	VisibleChunk* chunk = mVisibleObjects.data();
+	for (int32_t cy = chunkRect.GetTop(); cy < chunkRect.GetBottom(); cy++)
+	{
+		for (int32_t cx = chunkRect.GetLeft(); cx < chunkRect.GetRight(); cx++, chunk++)
+		{
+			uint32_t version = grid.GetChunkVersion(cx, cy);
+			Rect query = mVisibleRect.GetIntersection(grid.GetChunkReach(cx, cy));
+			if (chunk->mVersion == version && chunk->mQuery == query)
+				continue;
+			chunk->mVersion = version;
+			chunk->mQuery = query;
+			// scrolling changes the query of every chunk at the edge, most of them keep the same objects
+			mVisibleQuery.clear();
+			grid.QueryChunk(cx, cy, query, mVisibleQuery);
+			if (mVisibleQuery == chunk->mObjects)
+				continue;
+			chunk->mObjects.swap(mVisibleQuery);
+			changed = true;
+		}
+	}
+
+	if (changed)
+		mDisplayRebuild = true;
+}
+
 const Rect& MapView::GetVisibleRect()
 {
 	return mVisibleRect;
@@ -262,41 +369,372 @@ const Rect& MapView::GetVisibleRect()
 
 const CompoundPalette* MapView::AllocateCompoundPalette(const Color* basePalette)
 {
+	// many sprites share the same palette
+	uint64_t hash = PaletteRegistry::HashPalette(basePalette);
+	for (auto& pal : mObjectPalettes)
+	{
+		if (pal->GetHash() == hash && !memcmp(pal->GetBasePalette(), basePalette, sizeof(Color) * 256))
+			return pal;
+	}
+
 	CompoundPalette* pal = new CompoundPalette();
 	pal->SetBasePalette(basePalette);
-	pal->UpdatePalettes(Color(255, 255, 255, 255), 255, 255);
+	pal->UpdatePalettes(mLightTint, mLightBrightness, mLightContrast);
 	mObjectPalettes.push_back(pal);
 	return pal;
 }
 
-void MapView::EnqueueDrawCall(int order, MapViewDrawCall callback)
+void MapView::SetLighting(Color tint, uint16_t brightness, uint16_t contrast)
 {
+	if (tint == mLightTint && brightness == mLightBrightness && contrast == mLightContrast)
+		return;
+	mLightTint = tint;
+	mLightBrightness = brightness;
+	mLightContrast = contrast;
+
+	// new colors are generated over the next frames, see UpdatePendingPalettes. terrain drawn with old queued colors is dropped
+	mRepaintY = mRepaintBottom;
+	for (auto& pal : mTilePalettes)
+		pal.QueuePalettes(tint, brightness, contrast);
+	for (auto& pal : mObjectPalettes)
+		pal->QueuePalettes(tint, brightness, contrast);
+	mPalettesPending = true;
+}
 
-	DrawCallEntry ent;
-	ent.mWeight = order;
-	ent.mCallback = callback;
+void MapView::SetDeferredTerrain(bool deferred)
+{
+	if (mDeferredTerrain == deferred)
+		return;
+	mDeferredTerrain = deferred;
+	mLastDrawnRect = mLastVisibleRect = Rect::FromXYWH(0, 0, 0, 0);
+	ClearWater();
+	// everything is drawn again anyway
+	mRepaintY = mRepaintBottom;
+}
 
-	if (mDrawQueue.empty() || (!mDrawQueue.empty() > 0 && mDrawQueue.front().mWeight > order))
+bool MapView::IsDeferredTerrain()
+{
+	return mDeferredTerrain;
+}
+
+void MapView::UpdateTerrainLookup()
+{
+	// index is tile palette (2 bits), palette level (6 bits) and color (8 bits)
+	for (uint32_t i = 0; i < 4; i++)
 	{
-		mDrawQueue.push_front(ent);
+		if (mTilePalettes[i].GetPalette(0) == nullptr) // not loaded yet
+			continue;
+		for (uint32_t level = 0; level < 64; level++)
+			memcpy(mTerrainLookup.data() + ((i << 14) | (level << 8)), mTilePalettes[i].GetPalette(level), sizeof(Color) * 256);
+	}
+}
+
+void MapView::UpdatePendingPalettes()
+{
+	if (!mPalettesPending || IsRepainting())
 		return;
+
+	// only levels that current colors have are generated. until every palette is ready, everything is drawn with current colors
+	uint32_t budget = PaletteLevelsPerFrame;
+	for (auto& pal : mTilePalettes)
+	{
+		if (!pal.GeneratePending(budget))
+			return;
+	}
+	for (auto& pal : mObjectPalettes)
+	{
+		if (!pal->GeneratePending(budget))
+			return;
 	}
 
-	std::forward_list<DrawCallEntry>::iterator last = mDrawQueue.begin();
-	for (std::forward_list<DrawCallEntry>::iterator it = ++mDrawQueue.begin();
-		it != mDrawQueue.end(); ++it)
+	// indexed terrain only needs new lookup table. truecolor terrain has to be drawn again, that is spread over the next frames.
+	// it starts from a copy, so pixels not covered by visible nodes stay the same
+	if (!mDeferredTerrain && mVisibleRect.h > 0)
 	{
-		if (it->mWeight > order)
+		memcpy(mTerrainBack->GetBuffer(), mTerrain->GetBuffer(), mTerrain->GetWidth() * mTerrain->GetHeight() * sizeof(Color));
+		mRepaintY = mVisibleRect.GetTop();
+		mRepaintBottom = mVisibleRect.GetBottom();
+		return;
+	}
+
+	CommitPalettes();
+}
+
+void MapView::CommitPalettes()
+{
+	// switch terrain and objects in the same frame
+	for (auto& pal : mTilePalettes)
+		pal.CommitPending();
+	for (auto& pal : mObjectPalettes)
+		pal->CommitPending();
+	mPalettesPending = false;
+
+	if (mDeferredTerrain)
+		UpdateTerrainLookup();
+	// sprite commands point into palette colors
+	mDisplayRebuild = true;
+	AddDamage(GetClipRect());
+}
+
+void MapView::EnqueueDraw(const MapDrawCommand& command)
+{
+	mDrawCommands.push_back(command);
+}
+
+void MapView::UpdateDisplayList()
+{
+	if (!mDisplayRebuild)
+	{
+		// objects that changed look are drawn again into their old commands, as long as they sort the same way
+		for (auto& handle : mDisplayDirty)
 		{
-			mDrawQueue.insert_after(last, ent);
+			const MapObjectState* state = mSnapshot->GetObject(handle);
+			if (!state || handle.mIndex >= mDisplayRanges.size() || mDisplayRanges[handle.mIndex].mBuild != mDisplayBuild)
+				continue;
+			const DisplayRange& range = mDisplayRanges[handle.mIndex];
+			uint32_t first = mDrawCommands.size();
+			if (state->mDraw)
+				state->mDraw(this, *state);
+			bool sameOrder = (mDrawCommands.size() - first == range.mCount);
+			for (uint32_t i = 0; i < range.mCount && sameOrder; i++)
+			{
+				const MapDrawCommand& oldCmd = mDrawCommands[range.mFirst + i];
+				const MapDrawCommand& newCmd = mDrawCommands[first + i];
+				sameOrder = (oldCmd.mSortKey == newCmd.mSortKey && oldCmd.mSprite == newCmd.mSprite);
+			}
+			if (!sameOrder)
+			{
+				mDrawCommands.resize(first);
+				mDisplayRebuild = true;
+				break;
+			}
+			for (uint32_t i = 0; i < range.mCount; i++)
+			{
+				DamageCommand(mDrawCommands[range.mFirst + i]);
+				DamageCommand(mDrawCommands[first + i]);
+			}
+			std::copy(mDrawCommands.begin() + first, mDrawCommands.end(), mDrawCommands.begin() + range.mFirst);
+			mDrawCommands.resize(first);
+		}
+		mDisplayDirty.clear();
+		if (!mDisplayRebuild)
 			return;
+	}
+
+	mDisplayDirty.clear();
+	mDisplayBuild++;
+	for (auto& cmd : mDrawCommands)
+		DamageCommand(cmd);
+	mDrawCommands.clear();
+	for (auto& chunk : mVisibleObjects)
+	{
+		for (auto& handle : chunk.mObjects)
+		{
+			// visible objects are only listed again when chunks change, states are taken from the current snapshot
+			const MapObjectState* state = mSnapshot->GetObject(handle);
+			if (!state)
+				continue;
+			uint32_t first = mDrawCommands.size();
+			if (state->mDraw)
+				state->mDraw(this, *state);
+			uint32_t slot = handle.mIndex;
+			if (slot >= mDisplayRanges.size())
+				mDisplayRanges.resize(slot + 1, DisplayRange{ 0, 0, 0 });
+			DisplayRange& range = mDisplayRanges[slot];
+			range.mBuild = mDisplayBuild;
+			range.mFirst = first;
+			range.mCount = mDrawCommands.size() - first;
 		}
+	}
+
+	for (auto& cmd : mDrawCommands)
+		DamageCommand(cmd);
+	SortDrawCommands();
+	mDisplayRebuild = false;
+}
 
-		last++;
+void MapView::SortDrawCommands()
+{
+	// key is biased y in the top 16 bits and a sprite hint in the low 16 bits, so that equal y groups by sprite.
+	// index is kept in the low half, the sort is stable
+	mDrawOrder.resize(mDrawCommands.size());
+	mDrawOrderTemp.resize(mDrawCommands.size());
+	for (size_t i = 0; i < mDrawCommands.size(); i++)
+	{
+		const MapDrawCommand& cmd = mDrawCommands[i];
+		uint32_t y = uint32_t(std::max(-32768, std::min(32767, cmd.mSortKey)) + 32768);
+		uint32_t spriteHint = uint32_t(uintptr_t(cmd.mSprite) >> 4) & 0xFFFF;
+		mDrawOrder[i] = (uint64_t((y << 16) | spriteHint) << 32) | i;
+	}
+
+	// LSD radix, 8 bits per pass over the key half
+	for (uint32_t shift = 32; shift < 64; shift += 8)
+	{
+		uint32_t counts[256] = { 0 };
+		for (auto& order : mDrawOrder)
+			counts[(order >> shift) & 0xFF]++;
+		uint32_t offset = 0;
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t count = counts[i];
+			counts[i] = offset;
+			offset += count;
+		}
+		for (auto& order : mDrawOrder)
+			mDrawOrderTemp[counts[(order >> shift) & 0xFF]++] = order;
+		mDrawOrder.swap(mDrawOrderTemp);
 	}
+}
 
-	mDrawQueue.insert_after(last, ent);
+void MapView::ExecuteDrawCommands()
+{
+	Rect clip = Rect(GetClipRect()).GetIntersection(Application::GetInstance()->GetScreen()->GetViewport());
+	if (clip.w <= 0 || clip.h <= 0)
+		return;
+	if (mShadowMask.size() != size_t(clip.w * clip.h))
+		mShadowMask.assign(clip.w * clip.h, 0);
+
+#ifdef ALLODS_BENCHMARKS
+	if (mVerifyBinnedDraw)
+	{
+		mVerifyBinnedDraw = false;
+		VerifyBinnedDraw(clip);
+		return;
+	}
+#endif
 
+	DrawCommands(clip, mBinnedDraw);
+}
+
+void MapView::DrawCommands(const Rect& clip, bool binned)
+{
+	// every command goes to each horizontal bin it covers, in sorted order. bins don't share pixels,
+	// so they are drawn in parallel and the result is the same as drawing everything at once
+	uint32_t numBins = binned ? (clip.h + BinHeight - 1) / BinHeight : 1;
+	int32_t binHeight = binned ? BinHeight : clip.h;
+	if (mBins.size() < numBins)
+		mBins.resize(numBins);
+	for (uint32_t i = 0; i < numBins; i++)
+		mBins[i].clear();
+	int32_t scrollY = mScrollY * 32;
+	for (uint32_t i = 0; i < mDrawOrder.size(); i++)
+	{
+		const MapDrawCommand& cmd = mDrawCommands[uint32_t(mDrawOrder[i])];
+		int32_t top = cmd.mY - scrollY - clip.y;
+		int32_t bottom = top + cmd.mSprite->GetHeight(cmd.mFrame);
+		if (bottom <= 0 || top >= clip.h)
+			continue;
+		uint32_t firstBin = std::max(top, 0) / binHeight;
+		uint32_t lastBin = std::min(bottom - 1, clip.h - 1) / binHeight;
+		for (uint32_t bin = firstBin; bin <= lastBin; bin++)
+			mBins[bin].push_back(i);
+	}
+
+	if (numBins == 1)
+		DrawBin(0, clip, clip);
+	else
+	{
+		WorkerPool::GetDefault()->Run(numBins, [&](uint32_t bin)
+		{
+			int32_t y = clip.y + bin * binHeight;
+			DrawBin(bin, clip, Rect::FromLTRB(clip.GetLeft(), y, clip.GetRight(), std::min(y + binHeight, clip.GetBottom())));
+		});
+	}
+}
+
+#ifdef ALLODS_BENCHMARKS
+void MapView::VerifyBinnedDraw(const Rect& clip)
+{
+	// same commands over the same terrain, drawn serially and then in bins. both have to produce the same pixels
+	DrawingContext ctx(Application::GetInstance()->GetScreen());
+	std::vector<Color> background(clip.w * clip.h);
+	std::vector<Color> serial(clip.w * clip.h);
+	for (int32_t y = 0; y < clip.h; y++)
+		memcpy(&background[y * clip.w], ctx.GetBuffer() + ctx.GetPitch() * (clip.y + y) + clip.x, clip.w * sizeof(Color));
+
+	DrawCommands(clip, false);
+	for (int32_t y = 0; y < clip.h; y++)
+	{
+		Color* row = ctx.GetBuffer() + ctx.GetPitch() * (clip.y + y) + clip.x;
+		memcpy(&serial[y * clip.w], row, clip.w * sizeof(Color));
+		memcpy(row, &background[y * clip.w], clip.w * sizeof(Color));
+	}
+
+	DrawCommands(clip, true);
+	uint32_t mismatches = 0;
+	for (int32_t y = 0; y < clip.h; y++)
+	{
+		Color* row = ctx.GetBuffer() + ctx.GetPitch() * (clip.y + y) + clip.x;
+		for (int32_t x = 0; x < clip.w; x++)
+		{
+			if (row[x].value != serial[y * clip.w + x].value)
+				mismatches++;
+		}
+	}
+
+	if (mismatches)
+		Printf("Binned drawing: %u of %u pixels differ from serial drawing", mismatches, uint32_t(clip.w * clip.h));
+	else Printf("Binned drawing: identical to serial drawing (%u commands)", uint32_t(mDrawOrder.size()));
+}
+#endif
+
+void MapView::DrawBin(uint32_t bin, const Rect& clip, const Rect& binRect)
+{
+	DrawingContext ctx(Application::GetInstance()->GetScreen(), binRect);
+	int32_t scrollX = mScrollX * 32;
+	int32_t scrollY = mScrollY * 32;
+	const std::vector<uint32_t>& commands = mBins[bin];
+
+	// shadows are accumulated into the mask in depth order. power p becomes coverage 256 - 256 / p, so that resolve matches rgb / p.
+	// a sprite drawn over a pending shadow clears the mask under its own pixels, so every pixel keeps only the shadows drawn
+	// after whatever is visible in it. the result doesn't depend on where bins are split, and the mask is resolved once
+	uint8_t* mask = mShadowMask.data() + (binRect.y - clip.y) * clip.w;
+	int32_t left = binRect.GetRight(), top = binRect.GetBottom(), right = binRect.GetLeft(), bottom = binRect.GetTop();
+	for (uint32_t i : commands)
+	{
+		const MapDrawCommand& cmd = mDrawCommands[uint32_t(mDrawOrder[i])];
+		int32_t x = cmd.mX - scrollX;
+		int32_t y = cmd.mY - scrollY;
+		if (cmd.mKind == MapDrawCommand::Shadow)
+		{
+			if (cmd.mLevel < 2)
+				continue;
+			uint8_t value = uint8_t(std::min(256 - 256 / cmd.mLevel, 255));
+			Rect touched = cmd.mSprite->DrawShadowMask(mask, clip.w, binRect, x, y, cmd.mFrame, cmd.mShadowOffset, value);
+			if (touched.w <= 0 || touched.h <= 0)
+				continue;
+			left = std::min(left, touched.GetLeft());
+			top = std::min(top, touched.GetTop());
+			right = std::max(right, touched.GetRight());
+			bottom = std::max(bottom, touched.GetBottom());
+			continue;
+		}
+
+		if (left < right && top < bottom &&
+			x < right && x + cmd.mSprite->GetWidth(cmd.mFrame) > left &&
+			y < bottom && y + cmd.mSprite->GetHeight(cmd.mFrame) > top)
+			cmd.mSprite->ClearMask(mask, clip.w, binRect, x, y, cmd.mFrame);
+
+		switch (cmd.mKind)
+		{
+		case MapDrawCommand::Sprite:
+			cmd.mSprite->Draw(ctx, x, y, cmd.mFrame, cmd.mPalette);
+			break;
+		case MapDrawCommand::SpriteFOW:
+			{
+				CellPalettes palettes;
+				GetFOWPalettes(cmd.mCompoundPalette, cmd.mLevel, palettes);
+				cmd.mSprite->DrawCells(ctx, x, y, cmd.mFrame, palettes);
+				break;
+			}
+		case MapDrawCommand::Shadow:
+			break;
+		}
+	}
+
+	// only the touched rect is resolved, and resolving clears it
+	if (left < right && top < bottom)
+		ResolveShadows(ctx, clip, Rect::FromLTRB(left, top, right, bottom));
 }
 
 uint32_t MapView::GetRenderID()
@@ -304,6 +742,94 @@ uint32_t MapView::GetRenderID()
 	return mRenderID;
 }
 
+void MapView::SetFusedFOW(bool fused)
+{
+	if (mFusedFOW == fused)
+		return;
+	mFusedFOW = fused;
+	// sprites are drawn with different commands
+	mDisplayRebuild = true;
+	// every cached terrain pixel is either darkened or not, redraw everything
+	std::fill(mFOWCells.begin(), mFOWCells.end(), FOWBorder);
+	mLastDrawnRect = mLastVisibleRect = Rect::FromXYWH(0, 0, 0, 0);
+}
+
+bool MapView::IsFusedFOW()
+{
+	return mFusedFOW;
+}
+
+void MapView::GetFOWPalettes(const CompoundPalette* palette, uint32_t level, CellPalettes& out)
+{
+	const Rect& rec = GetClipRect();
+	out.mCells = mFOWCells.data();
+	out.mPitch = mLogic->GetWidth();
+	out.mRows = mLogic->GetHeight();
+	// cell (0, 0) starts at the center of node (0, 0)
+	out.mOffsetX = rec.x - mScrollX * 32 + 16;
+	out.mOffsetY = rec.y - mScrollY * 32 + 16;
+	for (int i = 0; i < 4; i++)
+		out.mPalettes[i] = palette->GetPalette(mFOWLevels[i][level]);
+}
+
+// relative brightness of CompoundPalette level, same formula as palette generation
+static float levelBrightness(int level)
+{
+	if (level < 31)
+		return float(level) / 31;
+	if (level > 32)
+		return 1.0f + float((level - 32) * 2) / 31;
+	return 1.0f;
+}
+
+void MapView::UpdateFOWLevels()
+{
+	// fog multipliers match what DrawVisibility does for 0, 127 and 255. border cells are blended later, so not darkened here
+	static const float fowScale[4] = { 0, 127.0f / 256, 1, 1 };
+	for (int state = 0; state < 4; state++)
+	{
+		for (int level = 0; level < 65; level++)
+		{
+			float target = levelBrightness(level) * fowScale[state];
+			int bestLevel = 0;
+			for (int j = 1; j < 65; j++)
+			{
+				if (fabs(levelBrightness(j) - target) < fabs(levelBrightness(bestLevel) - target))
+					bestLevel = j;
+			}
+			mFOWLevels[state][level] = (state == FOWVisible || state == FOWBorder) ? level : bestLevel;
+		}
+	}
+}
+
+void MapView::InvalidateFOWCell(int32_t nx, int32_t ny)
+{
+	// cell covers map pixels between node centers. terrain nodes are displaced by height, so check a few rows around
+	int32_t top = ny * 32 + 16;
+	int32_t bottom = top + 32;
+	int32_t nodesPitch = mLogic->GetWidth();
+	const int8_t* heights = mSnapshot->mHeights.data();
+	for (int32_t y = ny - 5; y <= ny + 5; y++)
+	{
+		if (y < 0 || y + 1 >= mLogic->GetHeight())
+			continue;
+		for (int32_t x = nx; x <= nx + 1; x++)
+		{
+			if (x < 0 || x + 1 >= nodesPitch)
+				continue;
+			const int8_t* height = heights + y * nodesPitch + x;
+			int8_t h1 = *height;
+			int8_t h2 = *(height + 1);
+			int8_t h3 = *(height + nodesPitch);
+			int8_t h4 = *(height + nodesPitch + 1);
+			int32_t minY = y * 32 - std::max(std::max(h1, h2), std::max(h3, h4));
+			int32_t maxY = y * 32 + 32 - std::min(std::min(h1, h2), std::min(h3, h4));
+			if (maxY >= top && minY < bottom)
+				InvalidateNode(x, y);
+		}
+	}
+}
+
 void MapView::DrawTerrain()
 {
 	// draw terrain from x/y
@@ -311,18 +837,15 @@ void MapView::DrawTerrain()
 	bool doRecordNewVisible = false;
 	if (mLastVisibleRect != mVisibleRect)
 	{
-		// mark all new tiles as NeedRedraw
-		MapNode* nodes = mLogic->GetNodes() + mVisibleRect.y * mLogic->GetWidth() + mVisibleRect.x;
+		// mark all new tiles for redraw
 		Rect unpaddedLastVisible = mLastDrawnRect;
 		for (int y = mVisibleRect.y; y < mVisibleRect.GetBottom(); y++)
 		{
 			for (int x = mVisibleRect.x; x < mVisibleRect.GetRight(); x++)
 			{
 				if (!unpaddedLastVisible.Contains(Point(x, y)))
-					nodes->mFlags |= MapNode::NeedRedraw|MapNode::NeedRedrawFOW;
-				nodes++;
+					InvalidateNode(x, y);
 			}
-			nodes += mLogic->GetWidth() - mVisibleRect.w;
 		}
 		mLastVisibleRect = mVisibleRect;
 		doRecordNewVisible = true;
@@ -334,8 +857,17 @@ void MapView::DrawTerrain()
 			{
 				int deltaX = (mLastScrollX - mScrollX) * 32;
 				int deltaY = (mLastScrollY - mScrollY) * 32;
-				mTerrain->MoveInPlace(deltaX, deltaY);
-				mTerrainFOW->MoveInPlace(deltaX, deltaY);
+				if (mDeferredTerrain)
+				{
+					mTerrainIndexed->MoveInPlace(deltaX, deltaY);
+					MoveWater(deltaX, deltaY);
+				}
+				else
+				{
+					mTerrain->MoveInPlace(deltaX, deltaY);
+					if (IsRepainting())
+						mTerrainBack->MoveInPlace(deltaX, deltaY);
+				}
 			}
 			mLastScrollX = mScrollX;
 			mLastScrollY = mScrollY;
@@ -346,29 +878,78 @@ void MapView::DrawTerrain()
 	if (doRecordNewVisible)
 		mLastDrawnRect = Rect::FromLTRB(mVisibleRect.GetLeft()+4, mVisibleRect.GetBottom(), mVisibleRect.GetRight()-4, mVisibleRect.GetTop());
 
-	MapNode* nodes = mLogic->GetNodes() + mVisibleRect.y * mLogic->GetWidth() + mVisibleRect.x;
-	for (int32_t y = mVisibleRect.y; y < mVisibleRect.GetBottom(); y++)
+	RepaintTerrain();
+
+	// only nodes that were invalidated since the last frame are visited. idle frame does nothing here
+	DirtyNodeSet& dirty = mDirtyNodes;
+	if (!doRecordNewVisible && !dirty.AnyInRect(mVisibleRect))
 	{
-		bool allYDrawn = true;
-		int anyDrawn = false;
-		for (int32_t x = mVisibleRect.x; x < mVisibleRect.GetRight(); x++)
-		{
-			if (nodes->mFlags & (MapNode::NeedRedraw | MapNode::NeedRedrawFOW))
-			{
-				allYDrawn &= DrawTerrainNode(x, y, *nodes);
-				nodes->mFlags &= ~(MapNode::NeedRedraw|MapNode::NeedRedrawFOW);
-			}
-			nodes++;
-		}
-		if (doRecordNewVisible && allYDrawn)
+		// dirty nodes outside of the view are dropped: a node that is not in mLastDrawnRect
+		// is invalidated again when the view scrolls over it, so nothing is lost
+		dirty.Clear();
+		return;
+	}
+
+	std::vector<bool> rowsNotDrawn;
+	if (doRecordNewVisible)
+		rowsNotDrawn.resize(mVisibleRect.h, false);
+
+	dirty.Sort();
+	int32_t nodesPitch = mLogic->GetWidth();
+	for (auto& index : dirty.GetQueue())
+	{
+		int32_t x = index % nodesPitch;
+		int32_t y = index / nodesPitch;
+		if (!mVisibleRect.Contains(Point(x, y)))
+			continue;
+		bool fullyDrawn = DrawTerrainNode(x, y, false);
+		if (IsRepainting())
+			DrawTerrainNode(x, y, true);
+		if (doRecordNewVisible && !fullyDrawn)
+			rowsNotDrawn[y - mVisibleRect.y] = true;
+	}
+	// the queue never outlives a frame, so its size is bounded by changes made since the last one
+	dirty.Clear();
+
+	if (doRecordNewVisible)
+	{
+		for (int32_t y = mVisibleRect.y; y < mVisibleRect.GetBottom(); y++)
 		{
+			if (rowsNotDrawn[y - mVisibleRect.y])
+				continue;
 			mLastDrawnRect.SetBottom(std::max(mLastDrawnRect.GetBottom(), y));
 			mLastDrawnRect.SetTop(std::min(mLastDrawnRect.GetTop(), y));
 		}
-		nodes += mLogic->GetWidth() - mVisibleRect.w;
 	}
 }
 
+void MapView::RepaintTerrain()
+{
+	if (!IsRepainting())
+		return;
+
+	// whole rows, top to bottom, so that overlapping nodes end up the same as after a full redraw.
+	// rows that scrolled out of view are skipped, they are drawn into both images when they come back
+	int32_t rows = std::max(1, int32_t(RepaintNodesPerFrame) / std::max(1, mVisibleRect.w));
+	int32_t nextY = std::min(mRepaintBottom, mRepaintY + rows);
+	for (int32_t y = std::max(mRepaintY, mVisibleRect.GetTop()); y < std::min(nextY, mVisibleRect.GetBottom()); y++)
+	{
+		for (int32_t x = mVisibleRect.GetLeft(); x < mVisibleRect.GetRight(); x++)
+			DrawTerrainNode(x, y, true);
+	}
+	mRepaintY = nextY;
+	if (IsRepainting())
+		return;
+
+	std::swap(mTerrain, mTerrainBack);
+	CommitPalettes();
+}
+
+bool MapView::IsRepainting()
+{
+	return mRepaintY < mRepaintBottom;
+}
+
 // produce alpha value from fog of war flag
 static uint8_t alphaFromVisFlags(uint16_t flags)
 {
@@ -379,20 +960,22 @@ static uint8_t alphaFromVisFlags(uint16_t flags)
 	return 0;
 }
 
-bool MapView::DrawTerrainNode(int32_t x, int32_t y, MapNode& node1)
+bool MapView::DrawTerrainNode(int32_t x, int32_t y, bool back)
 {
 
 	// nodes:
 	// node1 node2
 	// node3 node4
 
-	DrawingContext ctx(mTerrain);
+	DrawingContext ctx(back ? mTerrainBack : mTerrain);
 
 	int nodesPitch = mLogic->GetWidth();
-	MapNode* nodes = mLogic->GetNodes() + nodesPitch * y + x;
-	MapNode& node2 = *(nodes + 1);
-	MapNode& node3 = *(nodes + nodesPitch);
-	MapNode& node4 = *(nodes + nodesPitch + 1);
+	const int8_t* heights = mSnapshot->mHeights.data() + nodesPitch * y + x;
+	int8_t height1 = *heights;
+	int8_t height2 = *(heights + 1);
+	int8_t height3 = *(heights + nodesPitch);
+	int8_t height4 = *(heights + nodesPitch + 1);
+	uint16_t tile = mSnapshot->mTiles[nodesPitch * y + x];
 
 	uint8_t* shade = mTerrainShade.data() + nodesPitch * y + x;
 	uint8_t shade1 = *shade;
@@ -400,6 +983,13 @@ bool MapView::DrawTerrainNode(int32_t x, int32_t y, MapNode& node1)
 	uint8_t shade3 = *(shade + nodesPitch);
 	uint8_t shade4 = *(shade + nodesPitch + 1);
 
+	// dynamic light is added on top of static shade
+	int8_t* light = mTerrainLight.data() + nodesPitch * y + x;
+	shade1 = uint8_t(std::max(0, std::min(255, shade1 + *light)));
+	shade2 = uint8_t(std::max(0, std::min(255, shade2 + *(light + 1))));
+	shade3 = uint8_t(std::max(0, std::min(255, shade3 + *(light + nodesPitch))));
+	shade4 = uint8_t(std::max(0, std::min(255, shade4 + *(light + nodesPitch + 1))));
+
 	int x1 = (x - mScrollX) * 32;
 	int x2 = (x - mScrollX) * 32 + 32;
 	// for convenience
@@ -410,10 +1000,10 @@ bool MapView::DrawTerrainNode(int32_t x, int32_t y, MapNode& node1)
 	int y3 = (y - mScrollY) * 32 + 32;
 	int y4 = (y - mScrollY) * 32 + 32;
 
-	int y1h = y1 - node1.mHeight;
-	int y2h = y2 - node2.mHeight;
-	int y3h = y3 - node3.mHeight;
-	int y4h = y4 - node4.mHeight;
+	int y1h = y1 - height1;
+	int y2h = y2 - height2;
+	int y3h = y3 - height3;
+	int y4h = y4 - height4;
 	int minDrawY = std::min(std::min(y1h, y2h), std::min(y3h, y4h));
 	int maxDrawY = std::max(std::max(y1h, y2h), std::max(y3h, y4h));
 
@@ -421,6 +1011,8 @@ bool MapView::DrawTerrainNode(int32_t x, int32_t y, MapNode& node1)
 		return false;
 
 	bool wouldFitInY = (minDrawY >= 0 && maxDrawY < mTerrain->GetHeight());
+	if (!back)
+		DamageNode(x, y);
 
 	if (x2 <= 0 || x1 >= mTerrain->GetWidth())
 		return wouldFitInY;
@@ -431,116 +1023,33 @@ bool MapView::DrawTerrainNode(int32_t x, int32_t y, MapNode& node1)
 	uint8_t brightness3 = shade3 / 4;
 	uint8_t brightness4 = shade4 / 4;
 
-	// fog of war
-	static uint8_t fow[32 * 32];
-	// if we are going to draw with a single color, just set it here
-	int singleFOWColor = -1;
-	if (node1.mFlags & MapNode::NeedRedrawFOW)
-	{
-		// get more nodes
-		// we have center and one to the right and bottom
-		// we also need up and left
-		// rename nodes a bit.. so that there is no confusion
-		MapNode& aux1 = *(nodes - nodesPitch - 1);
-		MapNode& aux2 = *(nodes - nodesPitch);
-		MapNode& aux3 = *(nodes - nodesPitch + 1);
-		MapNode& aux4 = *(nodes - 1);
-		MapNode& aux5 = node1;
-		MapNode& aux6 = node2;
-		MapNode& aux7 = *(nodes + nodesPitch - 1);
-		MapNode& aux8 = node3;
-		MapNode& aux9 = node4;
-
-		uint16_t f1 = aux1.mFlags & (MapNode::Discovered | MapNode::Visible);
-		uint16_t f2 = aux2.mFlags & (MapNode::Discovered | MapNode::Visible);
-		uint16_t f3 = aux3.mFlags & (MapNode::Discovered | MapNode::Visible);
-		uint16_t f4 = aux4.mFlags & (MapNode::Discovered | MapNode::Visible);
-		uint16_t f5 = aux5.mFlags & (MapNode::Discovered | MapNode::Visible);
-		uint16_t f6 = aux6.mFlags & (MapNode::Discovered | MapNode::Visible);
-		uint16_t f7 = aux7.mFlags & (MapNode::Discovered | MapNode::Visible);
-		uint16_t f8 = aux8.mFlags & (MapNode::Discovered | MapNode::Visible);
-		uint16_t f9 = aux9.mFlags & (MapNode::Discovered | MapNode::Visible);
-
-		bool differentFlags = f5 != f1 || f5 != f2 || f5 != f3 || f5 != f4 || f5 != f6 || f5 != f7 || f5 != f8 || f5 != f9;
-
-		if (!differentFlags)
-		{
-			singleFOWColor = alphaFromVisFlags(f5);
-		}
-		else
-		{
-
-			int np1 = alphaFromVisFlags(f1);
-			int np2 = alphaFromVisFlags(f2);
-			int np3 = alphaFromVisFlags(f3);
-			int np4 = alphaFromVisFlags(f4);
-			int np5 = alphaFromVisFlags(f5);
-			int np6 = alphaFromVisFlags(f6);
-			int np7 = alphaFromVisFlags(f7);
-			int np8 = alphaFromVisFlags(f8);
-			int np9 = alphaFromVisFlags(f9);
-
-			float topContrib = 0.5;
-			float yContrib = 0.5;
-			float bottomContrib = 0;
-			float fDelta = 1.0 / 32;
-			uint8_t* cbuf = fow;
-			for (int y = 0; y < 32; y++)
-			{
-				float leftContrib = 0.5;
-				float xContrib = 0.5;
-				float rightContrib = 0;
-
-				for (int x = 0; x < 32; x++)
-				{
-					int c1 = np1 * leftContrib + np2 * xContrib + np3 * rightContrib;
-					int c2 = np4 * leftContrib + np5 * xContrib + np6 * rightContrib;
-					int c3 = np7 * leftContrib + np8 * xContrib + np9 * rightContrib;
-					int c4 = c1 * topContrib + c2 * yContrib + c3 * bottomContrib;
-
-					*cbuf++ = c4;
-
-					if (x > 15)
-					{
-						leftContrib = 0;
-						rightContrib += fDelta;
-						xContrib -= fDelta;
-					}
-					else
-					{
-						leftContrib -= fDelta;
-						xContrib += fDelta;
-					}
-				}
-
-				if (y > 15)
-				{
-					topContrib = 0;
-					bottomContrib += fDelta;
-					yContrib -= fDelta;
-				}
-				else
-				{
-					topContrib -= fDelta;
-					yContrib += fDelta;
-				}
-			}
-
-		}
-	}
-
-	// draw tile
+	// draw tile. indexed terrain records water pixels in every phase, only water tiles differ
 	Color* buffer = ctx.GetBuffer();
-	ImagePaletted* tileImage = mTiles[(node1.mTile & 0xFF0) >> 4];
-	uint8_t* tileBuffer = tileImage->GetBuffer() + tileImage->GetWidth() * ((node1.mTile & 0x00F) * 32);
-	uint8_t* fowBuffer = mTerrainFOW->GetBuffer();
-	const CompoundPalette& paletteBuffer = mTilePalettes[(node1.mTile & 0xF00) >> 8];
+	uint16_t* indexedBuffer = mTerrainIndexed->GetBuffer();
+	uint8_t* tileBuffers[WaterPhases];
+	for (uint32_t phase = 0; phase < WaterPhases; phase++)
+	{
+		ImagePaletted* phaseImage = mTiles[(GetWaterTile(tile, mDeferredTerrain ? phase : mWaterPhase) & 0xFF0) >> 4];
+		tileBuffers[phase] = phaseImage->GetBuffer() + phaseImage->GetWidth() * ((tile & 0x00F) * 32);
+	}
+	bool isWater = GetWaterTile(tile, 1) != tile;
+	uint16_t indexedPalette = ((tile & 0xF00) >> 8) << 14;
+	ImagePaletted* tileImage = mTiles[(tile & 0xFF0) >> 4];
+	// truecolor terrain only has the current phase
+	uint8_t* tileBuffer = tileBuffers[0];
+	const CompoundPalette& paletteBuffer = mTilePalettes[(tile & 0xF00) >> 8];
 	int terrainPitch = mTerrain->GetWidth();
+	int32_t scrollPixelsY = mScrollY * 32 - 16;
+	int32_t lastCellY = mLogic->GetHeight() - 1;
 	for (int lx = 0; lx < 32; lx++)
 	{
+		// fog of war cells of this column, when fused with palettes. half a node at the map edge has no cell, the nearest one is used
+		int32_t cellX = std::max(0, std::min(nodesPitch - 1, (x * 32 + lx - 16) >> 5));
+		const uint8_t* cellColumn = mFOWCells.data() + cellX;
+
 		float fX = float(lx) / 31;
-		int hMin = node2.mHeight * fX + node1.mHeight * (1 - fX);
-		int hMax = node4.mHeight * fX + node3.mHeight * (1 - fX);
+		int hMin = height2 * fX + height1 * (1 - fX);
+		int hMax = height4 * fX + height3 * (1 - fX);
 		int yMin = y1 - hMin;
 		int yMax = y3 - hMax;
 		if (yMax < yMin)
@@ -550,17 +1059,12 @@ bool MapView::DrawTerrainNode(int32_t x, int32_t y, MapNode& node1)
 		int yCount = yMax - yMin;
 		float fScale = float(32) / yCount;
 		
-		float brightnessX1, brightnessX2;
-		if (node1.mFlags & MapNode::NeedRedraw)
-		{
-			brightnessX1 = brightness2 * fX + brightness1 * (1 - fX);
-			brightnessX2 = brightness4 * fX + brightness3 * (1 - fX);
-		}
+		float brightnessX1 = brightness2 * fX + brightness1 * (1 - fX);
+		float brightnessX2 = brightness4 * fX + brightness3 * (1 - fX);
 
 		uint8_t* tilePost = tileBuffer + lx;
 		Color* post = buffer + yMin * terrainPitch + lx + x1;
-		uint8_t* fowBufferPost = fow + lx;
-		uint8_t* fowPost = fowBuffer + yMin * terrainPitch + lx + x1;
+		int32_t indexedOffset = yMin * terrainPitch + lx + x1;
 		for (int ly = yMin; ly < yMax; ly++)
 		{
 			if (ly >= 0 && ly < mTerrain->GetHeight())
@@ -569,68 +1073,300 @@ bool MapView::DrawTerrainNode(int32_t x, int32_t y, MapNode& node1)
 				if (inY > 31) inY = 31;
 				if (inY < 0) inY = 0;
 				float fY = float(inY) / 31;
-				int brightnessY;
-				if (node1.mFlags & MapNode::NeedRedraw)
+				int brightnessY = float(brightnessX2 * fY + brightnessX1 * (1 - fY));
+				if (mFusedFOW)
 				{
-					brightnessY = float(brightnessX2 * fY + brightnessX1 * (1 - fY));
-					uint8_t palColor = *(tilePost + inY * tileImage->GetWidth());
-					*post = paletteBuffer.GetPalette(brightnessY)[palColor];
+					int32_t cellY = std::max(0, std::min(lastCellY, (ly + scrollPixelsY) >> 5));
+					brightnessY = mFOWLevels[cellColumn[cellY * nodesPitch]][brightnessY];
 				}
-				if (node1.mFlags & MapNode::NeedRedrawFOW)
+				uint8_t palColor = *(tilePost + inY * tileImage->GetWidth());
+				if (mDeferredTerrain)
 				{
-					uint8_t fowByte = (singleFOWColor >= 0) ? singleFOWColor : *(fowBufferPost + inY * 32);
-					*fowPost = fowByte;
+					uint16_t indexed = indexedPalette | (std::min(brightnessY, 63) << 8);
+					if (isWater)
+					{
+						WaterPixel water;
+						water.mOffset = indexedOffset;
+						for (uint32_t phase = 0; phase < WaterPhases; phase++)
+							water.mPhases[phase] = indexed | tileBuffers[phase][lx + inY * tileImage->GetWidth()];
+						indexedBuffer[indexedOffset] = water.mPhases[mWaterPhase];
+						mWater.push_back(water);
+						if (!mWaterMask[indexedOffset])
+						{
+							mWaterMask[indexedOffset] = 1;
+							mWaterLive++;
+						}
+					}
+					else
+					{
+						indexedBuffer[indexedOffset] = indexed | palColor;
+						if (mWaterMask[indexedOffset])
+						{
+							mWaterMask[indexedOffset] = 0;
+							mWaterLive--;
+						}
+					}
 				}
+				else if (back)
+					*post = paletteBuffer.GetPendingPalette(brightnessY)[palColor];
+				else *post = paletteBuffer.GetPalette(brightnessY)[palColor];
 			}
 			post += terrainPitch;
-			fowPost += terrainPitch;
+			indexedOffset += terrainPitch;
 		}
 	}
 
-	if (node1.mFlags & MapNode::NeedRedraw)
+	// node grid is only drawn into truecolor terrain, indexed terrain has no spare colors for it
+	if (!mDeferredTerrain)
 	{
-		ctx.DrawLine(Point(x1, y1 - node1.mHeight), Point(x2, y2 - node2.mHeight), Color(128, 0, 0, 255));
-		ctx.DrawLine(Point(x1, y1 - node1.mHeight), Point(x3, y3 - node3.mHeight), Color(128, 0, 0, 255));
+		ctx.DrawLine(Point(x1, y1 - height1), Point(x2, y2 - height2), Color(128, 0, 0, 255));
+		ctx.DrawLine(Point(x1, y1 - height1), Point(x3, y3 - height3), Color(128, 0, 0, 255));
 	}
 
 	return wouldFitInY;
 
 }
 
-void MapView::DrawVisibility()
+#ifdef ALLODS_SSE2
+// multiplies 4 pixels by 4 alpha values (0-256, each repeated twice in alpha)
+static inline __m128i DarkenPixels4(__m128i pixels, __m128i alpha)
 {
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_unpacklo_epi32(alpha, alpha));
+	__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), _mm_unpackhi_epi32(alpha, alpha));
+	__m128i result = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+	// alpha byte of the screen is kept as is
+	__m128i alphaMask = _mm_set1_epi32(0xFF000000);
+	return _mm_or_si128(_mm_andnot_si128(alphaMask, result), _mm_and_si128(alphaMask, pixels));
+}
+#endif
 
-	// this logic is pretty much from DrawPartial of the image, except it draws shadows instead of alpha
-	// first, take rect in screen space and clip it to viewport
-	const Rect& rec = GetClipRect();
-	DrawingContext ctx(Application::GetInstance()->GetScreen(), rec);
+// darkens a horizontal span between two node centers. fx is position inside the 32 pixel cell, v1 and v2 are fog values at the cell sides
+static void ApplyFOWSpan(Color* buffer, int32_t count, int32_t fx, int32_t v1, int32_t v2)
+{
+	int32_t i = 0;
+
+#ifdef ALLODS_SSE2
+	// alpha = (v1 * (32 - fx) + v2 * fx) / 32, then 255 is scaled to 256 so that visible pixels are unchanged
+	__m128i base = _mm_set1_epi16(int16_t(v1 * 32 + 16));
+	__m128i step = _mm_set1_epi16(int16_t(v2 - v1));
+	__m128i lanes = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i fxv = _mm_add_epi16(_mm_set1_epi16(int16_t(fx + i)), lanes);
+		__m128i alpha = _mm_srli_epi16(_mm_add_epi16(base, _mm_mullo_epi16(step, fxv)), 5);
+		alpha = _mm_add_epi16(alpha, _mm_srli_epi16(alpha, 7));
 
-	int terrainW = mTerrainFOW->GetWidth();
-	int terrainH = mTerrainFOW->GetHeight();
+		__m128i* pixels = (__m128i*)(buffer + i);
+		_mm_storeu_si128(pixels, DarkenPixels4(_mm_loadu_si128(pixels), _mm_unpacklo_epi16(alpha, alpha)));
+		_mm_storeu_si128(pixels + 1, DarkenPixels4(_mm_loadu_si128(pixels + 1), _mm_unpackhi_epi16(alpha, alpha)));
+	}
+#endif
 
-	Rect innerRect = Rect::FromXYWH(0, 0, terrainW, terrainH);
+	for (; i < count; i++)
+	{
+		int32_t alpha = (v1 * 32 + (v2 - v1) * (fx + i) + 16) >> 5;
+		alpha += alpha >> 7;
+		Color& c = buffer[i];
+		c.components.r = (c.components.r * alpha) >> 8;
+		c.components.g = (c.components.g * alpha) >> 8;
+		c.components.b = (c.components.b * alpha) >> 8;
+	}
+}
 
-	Rect viewRec = ctx.GetViewport();
-	Rect screenRec = Rect::FromXYWH(rec.x, rec.y, innerRect.w, innerRect.h).GetIntersection(viewRec);
-	if (screenRec.w > terrainW) screenRec.w = terrainW;
-	if (screenRec.h > terrainH) screenRec.h = terrainH;
-	Rect clipRec = Rect::FromXYWH(screenRec.x - rec.x + innerRect.x, screenRec.y - rec.y + innerRect.y, screenRec.w, screenRec.h).GetIntersection(Rect::FromXYWH(0, 0, terrainW, terrainH));
+// darkens a horizontal span by shadow coverage (0 - 255) and clears the coverage
+static void ResolveShadowSpan(Color* buffer, uint8_t* mask, int32_t count)
+{
+	int32_t i = 0;
 
-	Color* screenBuffer = ctx.GetBuffer() + screenRec.y * ctx.GetPitch() + screenRec.x;
-	uint8_t* buffer = mTerrainFOW->GetBuffer() + clipRec.y * terrainW + clipRec.x;
+#ifdef ALLODS_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128i full = _mm_set1_epi16(256);
+	for (; i + 4 <= count; i += 4)
+	{
+		uint32_t coverage;
+		memcpy(&coverage, mask + i, 4);
+		if (!coverage)
+			continue;
+		__m128i alpha = _mm_sub_epi16(full, _mm_unpacklo_epi8(_mm_cvtsi32_si128(int32_t(coverage)), zero));
+		__m128i* pixels = (__m128i*)(buffer + i);
+		_mm_storeu_si128(pixels, DarkenPixels4(_mm_loadu_si128(pixels), _mm_unpacklo_epi16(alpha, alpha)));
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		int32_t alpha = 256 - mask[i];
+		Color& c = buffer[i];
+		c.components.r = (c.components.r * alpha) >> 8;
+		c.components.g = (c.components.g * alpha) >> 8;
+		c.components.b = (c.components.b * alpha) >> 8;
+	}
 
-	for (int y = clipRec.GetTop(); y < clipRec.GetBottom(); y++)
+	memset(mask, 0, count);
+}
+
+void MapView::ResolveShadows(DrawingContext& ctx, const Rect& maskRect, const Rect& bounds)
+{
+	for (int32_t y = bounds.GetTop(); y < bounds.GetBottom(); y++)
 	{
-		for (int x = clipRec.GetLeft(); x < clipRec.GetRight(); x++)
+		Color* buffer = ctx.GetBuffer() + ctx.GetPitch() * y + bounds.x;
+		uint8_t* mask = mShadowMask.data() + (y - maskRect.y) * maskRect.w + (bounds.x - maskRect.x);
+		ResolveShadowSpan(buffer, mask, bounds.w);
+	}
+}
+
+void MapView::UpdateFOW()
+{
+
+	// fog of war is sampled at node centers. grid starts one node before scroll, so that every pixel lies between two samples
+	int32_t gridW = mTerrain->GetWidth() / 32 + 3;
+	int32_t gridH = mTerrain->GetHeight() / 32 + 3;
+	mFOWGrid.resize(gridW * gridH);
+	uint8_t* grid = mFOWGrid.data();
+	const uint16_t* flags = mSnapshot->mFlags.data();
+	for (int32_t gy = 0; gy < gridH; gy++)
+	{
+		int32_t y = mScrollY - 1 + gy;
+		for (int32_t gx = 0; gx < gridW; gx++)
+		{
+			int32_t x = mScrollX - 1 + gx;
+			if (x < 0 || y < 0 || x >= mLogic->GetWidth() || y >= mLogic->GetHeight())
+				*grid++ = 0;
+			else *grid++ = alphaFromVisFlags(flags[y * mLogic->GetWidth() + x]);
+		}
+	}
+
+	// a sample affects screen up to the neighbour samples. after scrolling the whole view is damaged anyway
+	if (mLastFOWGrid.size() == mFOWGrid.size())
+	{
+		const Rect& rec = GetClipRect();
+		for (int32_t gy = 0; gy < gridH; gy++)
 		{
-			screenBuffer->components.r = screenBuffer->components.r * (*buffer) / 255;
-			screenBuffer->components.g = screenBuffer->components.g * (*buffer) / 255;
-			screenBuffer->components.b = screenBuffer->components.b * (*buffer) / 255;
-			screenBuffer++;
-			buffer++;
+			for (int32_t gx = 0; gx < gridW; gx++)
+			{
+				if (mFOWGrid[gy * gridW + gx] != mLastFOWGrid[gy * gridW + gx])
+					AddDamage(Rect::FromXYWH(rec.x + gx * 32 - 48, rec.y + gy * 32 - 48, 64, 64));
+			}
+		}
+	}
+	mLastFOWGrid = mFOWGrid;
+
+	if (!mFusedFOW)
+		return;
+
+	// shadows are resolved on screen after everything in the cell was drawn, so they can't be darkened through palettes.
+	// discovered cells with shadows are blended per pixel like border cells, so that the fog applies to shadows as well.
+	// visible cells have no fog and undiscovered ones are black either way. the display list is the one of the last frame
+	mFOWShadowCells.assign(gridW * gridH, 0);
+	for (auto& cmd : mDrawCommands)
+	{
+		if (cmd.mKind != MapDrawCommand::Shadow || cmd.mLevel < 2)
+			continue;
+		// cell x starts at the center of node x, the grid one node before scroll
+		int32_t left = cmd.mX + std::min<int32_t>(cmd.mShadowOffset, 0);
+		int32_t right = cmd.mX + cmd.mSprite->GetWidth(cmd.mFrame) + std::max<int32_t>(cmd.mShadowOffset, 0);
+		int32_t gx1 = std::max(0, ((left - 16) >> 5) - mScrollX + 1);
+		int32_t gx2 = std::min(gridW - 1, ((right - 1 - 16) >> 5) - mScrollX + 2);
+		int32_t gy1 = std::max(0, ((cmd.mY - 16) >> 5) - mScrollY + 1);
+		int32_t gy2 = std::min(gridH - 1, ((cmd.mY + cmd.mSprite->GetHeight(cmd.mFrame) - 1 - 16) >> 5) - mScrollY + 2);
+		for (int32_t gy = gy1; gy < gy2; gy++)
+		{
+			for (int32_t gx = gx1; gx < gx2; gx++)
+				mFOWShadowCells[gy * gridW + gx] = 1;
+		}
+	}
+
+	// classify cells between samples. uniform cells are darkened through palettes, the rest is blended per pixel.
+	// terrain under the cells that changed has to be rasterized again
+	grid = mFOWGrid.data();
+	for (int32_t gy = 0; gy < gridH - 1; gy++)
+	{
+		int32_t y = mScrollY - 1 + gy;
+		for (int32_t gx = 0; gx < gridW - 1; gx++)
+		{
+			int32_t x = mScrollX - 1 + gx;
+			if (x < 0 || y < 0 || x >= mLogic->GetWidth() || y >= mLogic->GetHeight())
+				continue;
+
+			uint8_t* sample = grid + gy * gridW + gx;
+			uint8_t value = sample[0];
+			uint8_t state = FOWBorder;
+			if (sample[1] == value && sample[gridW] == value && sample[gridW + 1] == value)
+				state = (value == 255) ? FOWVisible : (value == 0) ? FOWUndiscovered : FOWDiscovered;
+			if (state == FOWDiscovered && mFOWShadowCells[gy * gridW + gx])
+				state = FOWBorder;
+
+			uint8_t& lastState = mFOWCells[y * mLogic->GetWidth() + x];
+			if (lastState != state)
+			{
+				lastState = state;
+				InvalidateFOWCell(x, y);
+			}
+		}
+	}
+
+}
+
+void MapView::DrawVisibility()
+{
+
+	const Rect& rec = GetClipRect();
+	DrawingContext ctx(Application::GetInstance()->GetScreen(), rec);
+	Rect viewRec = ctx.GetViewport();
+	if (viewRec.w <= 0 || viewRec.h <= 0)
+		return;
+
+	int32_t gridW = mTerrain->GetWidth() / 32 + 3;
+	uint8_t* grid = mFOWGrid.data();
+	int32_t nodesPitch = mLogic->GetWidth();
+	int32_t lastCellX = mLogic->GetWidth() - 1;
+	int32_t lastCellY = mLogic->GetHeight() - 1;
+
+	// expand the grid with bilinear interpolation straight onto the screen
+	grid = mFOWGrid.data();
+	Color* screenBuffer = ctx.GetBuffer();
+	int32_t pitch = ctx.GetPitch();
+	for (int32_t sy = viewRec.GetTop(); sy < viewRec.GetBottom(); sy++)
+	{
+		int32_t v = sy - rec.y + 16;
+		int32_t fy = v & 31;
+		uint8_t* row1 = grid + (v >> 5) * gridW;
+		uint8_t* row2 = row1 + gridW;
+		// grid starts one node before scroll, cells are clamped to the map like everywhere else
+		const uint8_t* cellRow = mFOWCells.data() + std::max(0, std::min(lastCellY, mScrollY - 1 + (v >> 5))) * nodesPitch;
+		Color* line = screenBuffer + sy * pitch;
+
+		int32_t sx = viewRec.GetLeft();
+		while (sx < viewRec.GetRight())
+		{
+			int32_t u = sx - rec.x + 16;
+			int32_t cell = u >> 5;
+			int32_t fx = u & 31;
+			int32_t count = std::min(32 - fx, viewRec.GetRight() - sx);
+			if (mFusedFOW && cellRow[std::max(0, std::min(lastCellX, mScrollX - 1 + cell))] != FOWBorder)
+			{
+				// already darkened while drawing
+				sx += count;
+				continue;
+			}
+
+			int32_t v1 = (row1[cell] * (32 - fy) + row2[cell] * fy + 16) >> 5;
+			int32_t v2 = (row1[cell + 1] * (32 - fy) + row2[cell + 1] * fy + 16) >> 5;
+
+			if (v1 == 0 && v2 == 0)
+			{
+				// undiscovered
+				for (int32_t i = 0; i < count; i++)
+					line[sx + i].value &= 0xFF000000;
+			}
+			else if (v1 != 255 || v2 != 255)
+			{
+				ApplyFOWSpan(line + sx, count, fx, v1, v2);
+			}
+
+			sx += count;
 		}
-		screenBuffer += ctx.GetPitch() - clipRec.w;
-		buffer += terrainW - clipRec.w;
 	}
 
 }
@@ -641,181 +1377,421 @@ void MapView::Draw()
 	if (IsLoading())
 		return;
 
+	// take the newest snapshot. nothing is drawn until the simulation has published one
+	const MapSnapshot* snapshot = mSnapshots.Acquire();
+	if (snapshot == nullptr)
+		return;
+	mSnapshot = snapshot;
+	if (mSnapshot->mSequence != mSnapshotSequence)
+	{
+		mSnapshotSequence = mSnapshot->mSequence;
+		ApplySnapshot();
+	}
+
 	// begin frame
 	mRenderID++;
-	mDrawQueue.clear();
 
 	// update scrolling if UI wanted it
 	if (mUIScrollX != 0 || mUIScrollY != 0)
 		SetScroll(mScrollX + mUIScrollX, mScrollY + mUIScrollY);
 
+	// simulation ticks trees in the view
+	if (mVisibleRect != mPostedVisibleRect)
+	{
+		mLogic->SetViewRect(&mSnapshots, mVisibleRect);
+		mPostedVisibleRect = mVisibleRect;
+	}
+
+	// vision follows the cursor. mouse motion only updates hover, so the source is moved at most once per frame
+	if (mHoverX >= 0 && mHoverY >= 0 && (mHoverX != mVisionX || mHoverY != mVisionY))
+	{
+		int32_t x = mVisionX = mHoverX;
+		int32_t y = mVisionY = mHoverY;
+		mLogic->Post([this, x, y](MapLogic* logic) {
+			if (mCursorVision < 0)
+				mCursorVision = logic->AddVisionSource(x, y, 8, true);
+			else logic->MoveVisionSource(mCursorVision, x, y);
+		});
+	}
+
+	// scrolling changes everything on screen
+	if (mScrollX != mDamageScrollX || mScrollY != mDamageScrollY)
+	{
+		AddDamage(GetClipRect());
+		mDamageScrollX = mScrollX;
+		mDamageScrollY = mScrollY;
+	}
+
+	// lighting changes are applied to terrain and objects in the same frame
+	UpdatePendingPalettes();
+
+	// update fog of war, it may invalidate terrain
+	UpdateFOW();
+
 	// update new cells in terrain
 	DrawTerrain();
 
 	// blit terrain
 	const Rect& rec = GetClipRect();
 	DrawingContext ctx(Application::GetInstance()->GetScreen(), rec);
-	mTerrain->Blit(ctx, rec.x, rec.y);
+	if (mDeferredTerrain)
+		mTerrainIndexed->Blit(ctx, rec.x, rec.y);
+	else mTerrain->Blit(ctx, rec.x, rec.y);
 
-	// enqueue objects
-	MapNode* nodes = mLogic->GetNodes() + mVisibleRect.y * mLogic->GetWidth() + mVisibleRect.x;
-	for (int32_t y = mVisibleRect.y; y < mVisibleRect.GetBottom(); y++)
-	{
-		for (int32_t x = mVisibleRect.x; x < mVisibleRect.GetRight(); x++)
-		{
-			for (auto& object : nodes->mObjects)
-				object->CheckDraw(this);
-			nodes++;
-		}
-		nodes += mLogic->GetWidth() - mVisibleRect.w;
-	}
-
-	// draw objects
-	for (auto& ent : mDrawQueue)
-		ent.mCallback(this);
+	// draw objects. display list only changes when visible objects do
+	UpdateVisibleObjects();
+	UpdateDisplayList();
+	ExecuteDrawCommands();
 
 	// draw fog of war
 	DrawVisibility();
 	
 }
 
-void MapView::FixedTick()
+void MapView::ApplySnapshot()
 {
-	
-	// check water time and animate
-	mWaterAnimTime++;
-	if (mWaterAnimTime > 5)
+	const MapSnapshotChanges& changes = mSnapshot->mChanges;
+	if (changes.mAll)
 	{
-		mWaterAnimTime = 0;
-		MapNode* nodes = mLogic->GetNodes() + mVisibleRect.y * mLogic->GetWidth() + mVisibleRect.x;
-		for (int32_t y = mVisibleRect.y; y < mVisibleRect.GetBottom(); y++)
-		{
-			for (int32_t x = mVisibleRect.x; x < mVisibleRect.GetRight(); x++)
-			{
-				if (!(nodes->mFlags & MapNode::Visible))
-				{
-					nodes++;
-					continue;
-				}
+		UpdateShade();
+		UpdateLight();
+		mLastDrawnRect = mLastVisibleRect = Rect::FromXYWH(0, 0, 0, 0);
+		mVisibleChunks = Rect::FromXYWH(0, 0, 0, 0);
+		mDisplayRebuild = true;
+		AddDamage(GetClipRect());
+	}
+	else
+	{
+		for (auto& rect : changes.mShade)
+			UpdateShade(rect);
+		for (auto& rect : changes.mLight)
+			UpdateLight(rect);
+		int32_t nodesPitch = mLogic->GetWidth();
+		for (auto& index : changes.mNodes)
+			mDirtyNodes.Mark(index % nodesPitch, index / nodesPitch);
+		mDisplayDirty.insert(mDisplayDirty.end(), changes.mObjects.begin(), changes.mObjects.end());
+	}
 
-				// animate water
-				uint16_t tile = nodes->mTile;
-				uint16_t tilenum = (tile & 0xFF0) >> 4; // base rect
-				uint16_t tilein = tile & 0x00F; // number of picture inside rect
-				if (tilenum >= 0x20 && tilenum <= 0x2F)
-				{
-					tilenum -= 0x20;
-					uint16_t tilewi = tilenum / 4;
-					uint16_t tilew = tilenum % 4;
-					uint16_t waflocal = tilewi;
-					waflocal = ++waflocal % 4;
-					tilenum = 0x20 + (4 * waflocal) + tilew;
-					nodes->mTile = (uint16_t)((tilenum << 4) | tilein);
-					nodes->mFlags |= MapNode::NeedRedraw;
-				}
-				nodes++;
-			}
-			nodes += mLogic->GetWidth() - mVisibleRect.w;
+	// views spread palette rebuilds over several frames
+	SetLighting(mSnapshot->mLightTint, mSnapshot->mLightBrightness, mSnapshot->mLightContrast);
+
+	uint32_t waterPhase = (mSnapshot->mTick / WaterTicks) % WaterPhases;
+	if (waterPhase != mWaterPhase)
+	{
+		mWaterPhase = waterPhase;
+		AnimateWater();
+	}
+}
+
+void MapView::InvalidateNode(int32_t x, int32_t y)
+{
+	if (x < 0 || y < 0 || x >= mLogic->GetWidth() || y >= mLogic->GetHeight())
+		return;
+	mDirtyNodes.Mark(x, y);
+}
+
+void MapView::AddDamage(const Rect& rect)
+{
+	Rect damage = rect.GetIntersection(GetClipRect());
+	if (damage.w > 0 && damage.h > 0)
+		Application::GetInstance()->GetScreen()->AddDamage(damage);
+}
+
+void MapView::DamageNode(int32_t x, int32_t y)
+{
+	// same corners as in DrawTerrainNode
+	int32_t nodesPitch = mLogic->GetWidth();
+	const int8_t* heights = mSnapshot->mHeights.data() + nodesPitch * y + x;
+	int32_t top = (y - mScrollY) * 32 - std::max(*heights, *(heights + 1));
+	int32_t bottom = (y - mScrollY) * 32 + 32 - std::min(*(heights + nodesPitch), *(heights + nodesPitch + 1));
+	const Rect& rec = GetClipRect();
+	AddDamage(Rect::FromLTRB(rec.x + (x - mScrollX) * 32, rec.y + top, rec.x + (x - mScrollX) * 32 + 33, rec.y + bottom + 1));
+}
+
+void MapView::DamageCommand(const MapDrawCommand& cmd)
+{
+	// commands are drawn at screen position, see ExecuteDrawCommands
+	Rect rect = Rect::FromXYWH(cmd.mX - mScrollX * 32, cmd.mY - mScrollY * 32, cmd.mSprite->GetWidth(cmd.mFrame), cmd.mSprite->GetHeight(cmd.mFrame));
+	if (cmd.mKind == MapDrawCommand::Shadow)
+	{
+		if (cmd.mShadowOffset < 0)
+			rect.SetLeft(rect.GetLeft() + cmd.mShadowOffset);
+		else rect.SetRight(rect.GetRight() + cmd.mShadowOffset);
+	}
+	AddDamage(rect);
+}
+
+// water tiles (rects 0x20 - 0x2F) are 4 kinds of water in 4 animation frames. returns tile with its frame advanced by phase
+uint16_t MapView::GetWaterTile(uint16_t tile, uint32_t phase)
+{
+	uint16_t tilenum = (tile & 0xFF0) >> 4; // base rect
+	uint16_t tilein = tile & 0x00F; // number of picture inside rect
+	if (tilenum < 0x20 || tilenum > 0x2F)
+		return tile;
+	tilenum -= 0x20;
+	uint16_t tilewi = tilenum / 4;
+	uint16_t tilew = tilenum % 4;
+	tilenum = 0x20 + (4 * ((tilewi + phase) % 4)) + tilew;
+	return (tile & 0xF000) | (tilenum << 4) | tilein;
+}
+
+void MapView::AnimateWater()
+{
+	// indexed terrain has every phase of water pixels recorded, they are copied into the image.
+	// only water on screen changes. truecolor terrain draws visible water again
+	if (mDeferredTerrain)
+	{
+		// nodes drawn again add entries, don't let them pile up
+		if (mWater.size() > 2 * mWaterLive + 4096)
+			CompactWater();
+		uint16_t* indexedBuffer = mTerrainIndexed->GetBuffer();
+		for (auto& water : mWater)
+		{
+			if (mWaterMask[water.mOffset])
+				indexedBuffer[water.mOffset] = water.mPhases[mWaterPhase];
 		}
 	}
 
-	// update non-active objects (trees...)
-	std::forward_list<MapObject*> toErase;
-	MapNode* nodes = mLogic->GetNodes() + mVisibleRect.y * mLogic->GetWidth() + mVisibleRect.x;
-	for (int32_t y = mVisibleRect.GetBottom()-1; y >= mVisibleRect.y; y--)
+	const uint16_t* tiles = mSnapshot->mTiles.data() + mVisibleRect.y * mLogic->GetWidth() + mVisibleRect.x;
+	for (int32_t y = mVisibleRect.y; y < mVisibleRect.GetBottom(); y++)
 	{
-		for (int32_t x = mVisibleRect.GetRight()-1; x >= mVisibleRect.x; x--)
+		for (int32_t x = mVisibleRect.x; x < mVisibleRect.GetRight(); x++)
 		{
-			for (auto& object : nodes->mObjects)
+			if (GetWaterTile(*tiles, 1) != *tiles)
 			{
-				if (!object->IsAdded())
-				{
-					if (!object->Tick())
-						toErase.push_front(object);
-				}
+				if (mDeferredTerrain)
+					DamageNode(x, y);
+				else InvalidateNode(x, y);
 			}
-			nodes++;
+			tiles++;
 		}
-		nodes += mLogic->GetWidth() - mVisibleRect.w;
+		tiles += mLogic->GetWidth() - mVisibleRect.w;
+	}
+}
+
+void MapView::ClearWater()
+{
+	mWater.clear();
+	std::fill(mWaterMask.begin(), mWaterMask.end(), 0);
+	mWaterLive = 0;
+}
+
+void MapView::CompactWater()
+{
+	// newest entry of every pixel that is still water is kept, order is preserved. mask is 2 for pixels already kept
+	size_t kept = mWater.size();
+	for (size_t i = mWater.size(); i-- > 0; )
+	{
+		uint8_t& mask = mWaterMask[mWater[i].mOffset];
+		if (mask != 1)
+			continue;
+		mask = 2;
+		mWater[--kept] = mWater[i];
 	}
+	mWater.erase(mWater.begin(), mWater.begin() + kept);
+	for (auto& water : mWater)
+		mWaterMask[water.mOffset] = 1;
+}
 
-	for (auto& obj : toErase)
-		delete obj;
+void MapView::MoveWater(int32_t offsX, int32_t offsY)
+{
+	// same as ImageIndexed::MoveInPlace, pixels moved outside of the image are dropped
+	CompactWater();
+	std::fill(mWaterMask.begin(), mWaterMask.end(), 0);
+	int32_t w = mTerrainIndexed->GetWidth();
+	int32_t h = mTerrainIndexed->GetHeight();
+	size_t kept = 0;
+	for (auto& water : mWater)
+	{
+		int32_t x = int32_t(water.mOffset % w) + offsX;
+		int32_t y = int32_t(water.mOffset / w) + offsY;
+		if (x < 0 || y < 0 || x >= w || y >= h)
+			continue;
+		mWater[kept] = water;
+		mWater[kept].mOffset = y * w + x;
+		mWaterMask[y * w + x] = 1;
+		kept++;
+	}
+	mWater.resize(kept);
+	mWaterLive = kept;
+}
 
+// shade of a node depends only on height differences to the right and to the bottom neighbour.
+// normal is (-uz, -vz, 32), result is |dot(normal, sun)| * 48 + 104 (i.e. 64 + 96, then contrast lowered by 0.75)
+static void ShadeRow(const int8_t* heights, int32_t pitch, int32_t count, const float* sun, uint8_t* out)
+{
+	int32_t i = 0;
+
+#ifdef ALLODS_SSE2
+	__m128 sunX = _mm_set1_ps(sun[0]);
+	__m128 sunY = _mm_set1_ps(sun[1]);
+	__m128 sunZ = _mm_set1_ps(sun[2] * 32);
+	__m128 absMask = _mm_set1_ps(-0.0f);
+	__m128 normalZ = _mm_set1_ps(32 * 32);
+	__m128 scale = _mm_set1_ps(48);
+	__m128 offset = _mm_set1_ps(104);
+	for (; i + 4 <= count; i += 4)
+	{
+		const int8_t* n = heights + i;
+		__m128 h1 = _mm_setr_ps(n[0], n[1], n[2], n[3]);
+		__m128 h2 = _mm_setr_ps(n[1], n[2], n[3], n[4]);
+		__m128 h3 = _mm_setr_ps(n[pitch], n[pitch + 1], n[pitch + 2], n[pitch + 3]);
+		__m128 uz = _mm_sub_ps(h2, h1);
+		__m128 vz = _mm_sub_ps(h3, h1);
+		__m128 dot = _mm_sub_ps(_mm_sub_ps(sunZ, _mm_mul_ps(uz, sunX)), _mm_mul_ps(vz, sunY));
+		dot = _mm_andnot_ps(absMask, dot);
+		__m128 nl = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(uz, uz), _mm_mul_ps(vz, vz)), normalZ));
+		__m128 result = _mm_add_ps(_mm_div_ps(_mm_mul_ps(dot, scale), nl), offset);
+		__m128i result32 = _mm_cvttps_epi32(result);
+		__m128i result8 = _mm_packus_epi16(_mm_packs_epi32(result32, result32), _mm_setzero_si128());
+		int32_t packed = _mm_cvtsi128_si32(result8);
+		memcpy(out + i, &packed, 4);
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		const int8_t* n = heights + i;
+		float uz = float(n[1] - n[0]);
+		float vz = float(n[pitch] - n[0]);
+		float dot = fabsf(sun[2] * 32 - uz * sun[0] - vz * sun[1]);
+		float nl = sqrtf(uz * uz + vz * vz + 32 * 32);
+		out[i] = (uint8_t)(dot * 48 / nl + 104);
+	}
 }
 
-void MapView::UpdateShade()
+void MapView::UpdateSunVector()
 {
 	float sunang = mLogic->GetSolarAngle() * (M_PI / 180);
-	
+
 	float sunx = cos(sunang);
 	float suny = sin(sunang);
 	float sunz = -0.75;
 
 	float sunl = sqrt(sunx * sunx + suny * suny + sunz * sunz);
-	sunx /= sunl;
-	suny /= sunl;
-	sunz /= sunl;
-
-	uint8_t* result = mTerrainShade.data();
-	MapNode* nodes = mLogic->GetNodes();
-	for (int32_t y = 0; y < mLogic->GetHeight(); y++)
-	{
-		for (int32_t x = 0; x < mLogic->GetWidth(); x++)
-		{
-			
-			if ((x <= 1) || (y <= 1) ||
-				(x >= mLogic->GetWidth() - 2) || (y >= mLogic->GetHeight() - 2))
-			{
-				nodes++;
-				*result++ = 0;
-				continue;
-			}
-
-			// 
-			float p1x = x * 32.0;
-			float p1y = y * 32.0;
-			float p1z = nodes->mHeight;
+	mSun[0] = sunx / sunl;
+	mSun[1] = suny / sunl;
+	mSun[2] = sunz / sunl;
+}
 
-			float p2x = x * 32.0 + 32.0;
-			float p2y = y * 32.0;
-			float p2z = (nodes + 1)->mHeight;
+void MapView::ShadeNodes(int32_t y, int32_t x1, int32_t x2, uint8_t* out)
+{
+	int32_t w = mLogic->GetWidth();
+	int32_t h = mLogic->GetHeight();
 
-			float p3x = x * 32.0;
-			float p3y = y * 32.0 + 32.0;
-			float p3z = (nodes + mLogic->GetWidth())->mHeight;
+	// two nodes from every map edge are not shaded
+	if (y <= 1 || y >= h - 2)
+	{
+		memset(out, 0, x2 - x1);
+		return;
+	}
 
-			//
-			float ux = p2x - p1x;
-			float uy = p2y - p1y;
-			float uz = p2z - p1z;
+	int32_t innerX1 = std::max(x1, 2);
+	int32_t innerX2 = std::min(x2, w - 2);
+	for (int32_t x = x1; x < std::min(innerX1, x2); x++)
+		out[x - x1] = 0;
+	if (innerX2 > innerX1)
+		ShadeRow(mSnapshot->mHeights.data() + y * w + innerX1, w, innerX2 - innerX1, mSun, out + (innerX1 - x1));
+	for (int32_t x = std::max(innerX2, x1); x < x2; x++)
+		out[x - x1] = 0;
+}
 
-			float vx = p3x - p1x;
-			float vy = p3y - p1y;
-			float vz = p3z - p1z;
+void MapView::UpdateShade()
+{
+	UpdateSunVector();
 
-			//
-			float nx = (uy * vz) - (uz * vy);
-			float ny = (uz * vx) - (ux * vz);
-			float nz = (ux * vy) - (uy * vx);
+	// initial build. rows are split into bands and shaded in parallel
+	int32_t w = mLogic->GetWidth();
+	int32_t h = mLogic->GetHeight();
+	const int32_t bandHeight = 16;
+	uint32_t numBands = (h + bandHeight - 1) / bandHeight;
+	WorkerPool::GetDefault()->Run(numBands, [this, w, h, bandHeight](uint32_t band) {
 
-			//
-			float nl = sqrt((nx * nx) + (ny * ny) + (nz * nz));
-			nx /= nl;
-			ny /= nl;
-			nz /= nl;
+		int32_t y1 = band * bandHeight;
+		int32_t y2 = std::min(y1 + bandHeight, h);
+		for (int32_t y = y1; y < y2; y++)
+			ShadeNodes(y, 0, w, mTerrainShade.data() + y * w);
 
-			float dot = fabs(nx * sunx + ny * suny + nz * sunz) * 64.0 + 96.0;
-			dot = (dot - 128) * 0.75 + 128; // lower contrast
+	});
+}
 
-			nodes++;
-			*result++ = (uint8_t)dot;
+void MapView::UpdateShade(const Rect& rect)
+{
+	// height of a node is used by shade of the node itself, and of the nodes to the left and to the top
+	Rect shadeRect = rect.GetPadded(1).GetIntersection(Rect::FromXYWH(0, 0, mLogic->GetWidth(), mLogic->GetHeight()));
+	if (shadeRect.w <= 0 || shadeRect.h <= 0)
+		return;
 
+	int32_t w = mLogic->GetWidth();
+	std::vector<uint8_t> row(shadeRect.w);
+	for (int32_t y = shadeRect.GetTop(); y < shadeRect.GetBottom(); y++)
+	{
+		ShadeNodes(y, shadeRect.GetLeft(), shadeRect.GetRight(), row.data());
+		uint8_t* shade = mTerrainShade.data() + y * w + shadeRect.GetLeft();
+		for (int32_t i = 0; i < shadeRect.w; i++)
+		{
+			if (shade[i] == row[i])
+				continue;
+			shade[i] = row[i];
+			// terrain node uses shade of its 4 corners
+			int32_t x = shadeRect.GetLeft() + i;
+			InvalidateNode(x - 1, y - 1);
+			InvalidateNode(x, y - 1);
+			InvalidateNode(x - 1, y);
+			InvalidateNode(x, y);
 		}
 	}
 }
 
 void MapView::UpdateLight()
 {
+	UpdateLight(Rect::FromXYWH(0, 0, mLogic->GetWidth(), mLogic->GetHeight()));
+}
+
+void MapView::UpdateLight(const Rect& rect)
+{
+	Rect lightRect = rect.GetIntersection(Rect::FromXYWH(0, 0, mLogic->GetWidth(), mLogic->GetHeight()));
+	if (lightRect.w <= 0 || lightRect.h <= 0)
+		return;
+
+	// sum of every light touching the rect, not just the one that changed
+	std::vector<int32_t> sum(lightRect.w * lightRect.h, 0);
+	for (auto& light : mSnapshot->mLights)
+	{
+		if (!light.mIsActive || !light.mIntensity)
+			continue;
+		Rect stampRect = light.GetBounds().GetIntersection(lightRect);
+		if (stampRect.w <= 0 || stampRect.h <= 0)
+			continue;
 
+		const uint16_t* kernel = light.GetKernel(light.mRadius);
+		int32_t kernelPitch = light.mRadius * 2 + 1;
+		for (int32_t y = stampRect.GetTop(); y < stampRect.GetBottom(); y++)
+		{
+			const uint16_t* kernelRow = kernel + (y - light.mY + light.mRadius) * kernelPitch + (stampRect.GetLeft() - light.mX + light.mRadius);
+			int32_t* sumRow = sum.data() + (y - lightRect.GetTop()) * lightRect.w + (stampRect.GetLeft() - lightRect.GetLeft());
+			for (int32_t i = 0; i < stampRect.w; i++)
+				sumRow[i] += kernelRow[i] * light.mIntensity;
+		}
+	}
+
+	int32_t w = mLogic->GetWidth();
+	for (int32_t y = lightRect.GetTop(); y < lightRect.GetBottom(); y++)
+	{
+		const int32_t* sumRow = sum.data() + (y - lightRect.GetTop()) * lightRect.w;
+		int8_t* light = mTerrainLight.data() + y * w + lightRect.GetLeft();
+		for (int32_t i = 0; i < lightRect.w; i++)
+		{
+			int8_t value = int8_t(std::max(-128, std::min(127, sumRow[i] >> 8)));
+			if (light[i] == value)
+				continue;
+			light[i] = value;
+			// terrain node uses light of its 4 corners
+			int32_t x = lightRect.GetLeft() + i;
+			InvalidateNode(x - 1, y - 1);
+			InvalidateNode(x, y - 1);
+			InvalidateNode(x - 1, y);
+			InvalidateNode(x, y);
+		}
+	}
 }
\ No newline at end of file
@@ -4,13 +4,33 @@
 #include "../maplogic/MapLogic.h"
 #include "../data/ImagePaletted.h"
 #include "../data/ImageTruecolor.h"
+#include "../data/ImageIndexed.h"
+#include "../data/Sprite256.h"
 #include "CompoundPalette.h"
 #include "../screen/Rect.h"
-#include <forward_list>
-#include <functional>
+#include "../maplogic/MapBenchmarks.h"
 
-class MapView;
-typedef std::function<void(MapView*)> MapViewDrawCall;
+// one sprite drawn this frame. plain data, so the per frame list is a vector that keeps its capacity
+struct MapDrawCommand
+{
+	enum Kind
+	{
+		Sprite,
+		SpriteFOW, // palette of every screen cell is taken from fog of war
+		Shadow
+	};
+
+	uint8_t mKind;
+	uint8_t mLevel; // palette level for SpriteFOW, shadow power for Shadow
+	int16_t mShadowOffset;
+	Sprite256* mSprite;
+	uint32_t mFrame;
+	int32_t mX; // in map pixels, scroll is applied when drawing
+	int32_t mY;
+	const Color* mPalette; // Sprite
+	const CompoundPalette* mCompoundPalette; // SpriteFOW
+	int32_t mSortKey; // drawn from lower to higher
+};
 
 class MapView : public LoadingElement
 {
@@ -26,9 +46,6 @@ public:
 	// on map load
 	void SetDefaults();
 
-	// handles one playsim tick in MapLogic
-	void FixedTick();
-
 	//
 	void SetScroll(int32_t x, int32_t y);
 	int32_t GetScrollX();
@@ -39,37 +56,121 @@ public:
 	// we store palettes inside MapView and return references to sprites. colors in the palette are managed/regenerated by MapView.
 	const CompoundPalette* AllocateCompoundPalette(const Color* basePalette);
 
-	// this is used from MapObject::Draw and subclasses to handle z-ordering
-	void EnqueueDrawCall(int order, MapViewDrawCall callback);
+	// deferred terrain keeps palette indices and resolves them when blitting, so lighting changes don't redraw terrain
+	void SetDeferredTerrain(bool deferred);
+	bool IsDeferredTerrain();
+
+	// this is used from MapObjectState::mDraw. commands are sorted by key and then by sprite.
+	// objects are only drawn when they enter the view, or after their state changed
+	void EnqueueDraw(const MapDrawCommand& command);
 
 	// returns abstract number to describe current frame to not render things twice
 	uint32_t GetRenderID();
 
+	// fused fog of war: uniform areas are darkened through palette levels while drawing, only borders are blended per pixel
+	void SetFusedFOW(bool fused);
+	bool IsFusedFOW();
+	// per-cell palettes for Sprite256::DrawCells, based on the specified palette level
+	void GetFOWPalettes(const CompoundPalette* palette, uint32_t level, CellPalettes& out);
+
 private:
 
 	virtual void LoadingThread();
+
+	// everything the view shows comes from snapshots of the simulation. the newest is taken at the start of every frame,
+	// changes it lists are applied right away. map is only changed by posting messages to MapLogic
+	MapSnapshotBuffer mSnapshots;
+	const MapSnapshot* mSnapshot = nullptr;
+	uint32_t mSnapshotSequence = 0;
+	Rect mPostedVisibleRect;
+	void ApplySnapshot();
+
+	// terrain nodes to redraw
+	DirtyNodeSet mDirtyNodes;
+	void InvalidateNode(int32_t x, int32_t y);
+
+	// recalculates shade after heights in the rect have changed, and marks affected terrain nodes for redraw
+	void UpdateShade(const Rect& rect);
+	// restamps lights in the rect, and marks affected terrain nodes for redraw
+	void UpdateLight(const Rect& rect);
+	// global tint, brightness and contrast for terrain and object palettes
+	void SetLighting(Color tint, uint16_t brightness, uint16_t contrast);
+
 	void UpdateVisibleRect();
+	void UpdateVisibleObjects();
 	void UpdateShade();
+	void UpdateSunVector();
+	void ShadeNodes(int32_t y, int32_t x1, int32_t x2, uint8_t* out);
 	void UpdateLight();
 	
 	// terrain drawing
 	void DrawTerrain();
-	bool DrawTerrainNode(int32_t x, int32_t y, MapNode& node1);
+	// after lighting changes, truecolor terrain is drawn again with queued colors into mTerrainBack, this many nodes per frame.
+	// map rows [mRepaintY, mRepaintBottom) are left. nodes drawn meanwhile go to both images. when it's done, images are swapped
+	// in the same frame as palettes are switched, so terrain and objects change together
+	static const uint32_t RepaintNodesPerFrame = 256;
+	int32_t mRepaintY = 0;
+	int32_t mRepaintBottom = 0;
+	void RepaintTerrain();
+	bool IsRepainting();
+	// back draws with queued colors into mTerrainBack, without damaging the screen
+	bool DrawTerrainNode(int32_t x, int32_t y, bool back);
 
 	// visibility drawing
+	void UpdateFOW();
+	void UpdateFOWLevels();
+	void InvalidateFOWCell(int32_t nx, int32_t ny);
 	void DrawVisibility();
 
+	// screen damage. terrain nodes, fog of war samples and draw commands report what they change on screen
+	int32_t mDamageScrollX = -1;
+	int32_t mDamageScrollY = -1;
+	std::vector<uint8_t> mLastFOWGrid;
+	void AddDamage(const Rect& rect);
+	void DamageNode(int32_t x, int32_t y);
+	void DamageCommand(const MapDrawCommand& cmd);
+
 	bool mOwnLogic = false;
 	std::string mOwnMapPath;
 	MapLogic* mLogic;
 
 	// tile images
 	std::vector<ImagePaletted*> mTiles;
-	std::vector<CompoundPalette> mTilePalettes;
+	CompoundPalette mTilePalettes[4];
 
 	// terrain image
 	ImageTruecolor* mTerrain;
-	ImagePaletted* mTerrainFOW;
+	ImageTruecolor* mTerrainBack;
+	// same, but stores tile palette, palette level and color index for every pixel.
+	// water pixels hold the current animation phase, all their phases are kept in mWater
+	static const uint32_t WaterPhases = 4;
+	ImageIndexed* mTerrainIndexed;
+	std::vector<Color> mTerrainLookup;
+	// optional: indexed pixels have no room for the node grid lines and palette level 64, so truecolor is the default
+	bool mDeferredTerrain = false;
+	void UpdateTerrainLookup();
+
+	// lighting
+	Color mLightTint = Color(255, 255, 255, 255);
+	uint16_t mLightBrightness = 255;
+	uint16_t mLightContrast = 255;
+	// fog of war, one value per node around the visible area. interpolated when applied
+	std::vector<uint8_t> mFOWGrid;
+	// fused fog of war state per cell between node centers (cell x,y is between nodes x,y and x+1,y+1)
+	enum FOWCellState
+	{
+		FOWUndiscovered = 0,
+		FOWDiscovered = 1,
+		FOWVisible = 2,
+		FOWBorder = 3
+	};
+	bool mFusedFOW = true;
+	// cells nobody classified yet are border: terrain isn't darkened and the fog is blended per pixel, which is always right
+	std::vector<uint8_t> mFOWCells;
+	// cells of the fog of war grid (minus the last row and column) that shadows of the display list fall on
+	std::vector<uint8_t> mFOWShadowCells;
+	// palette level to use for every cell state and original level
+	uint8_t mFOWLevels[4][65];
 
 	//
 	int32_t mLastScrollX = -1;
@@ -80,31 +181,99 @@ private:
 	Rect mLastVisibleRect;
 	Rect mVisibleRect;
 
+	// objects overlapping visible rect, by chunk over mVisibleChunks. a chunk is listed again only when it comes into view,
+	// its version changes or the part of the visible rect its objects can reach changes. the rest is kept as it is
+	struct VisibleChunk
+	{
+		uint32_t mVersion;
+		Rect mQuery;
+		std::vector<MapObjectHandle> mObjects;
+	};
+	std::vector<VisibleChunk> mVisibleObjects;
+	std::vector<VisibleChunk> mVisibleObjectsTemp;
+	std::vector<MapObjectHandle> mVisibleQuery;
+	Rect mVisibleChunks;
+
 	// ui variables
 	uint64_t mLastScrollTime;
 	int32_t mUIScrollX;
 	int32_t mUIScrollY;
 	int32_t mHoverX;
 	int32_t mHoverY;
+	// vision source id is only used by messages, on the simulation thread
+	int32_t mCursorVision = -1;
+	int32_t mVisionX = -1;
+	int32_t mVisionY = -1;
 
-	// global terrain animation
-	uint64_t mWaterAnimTime;
+	// global terrain animation. water tiles are shown with their animation frame advanced by phase, which follows ticks
+	static const uint32_t WaterTicks = 6;
+	uint32_t mWaterPhase = 0;
+	uint16_t GetWaterTile(uint16_t tile, uint32_t phase);
+	void AnimateWater();
 
-	// object palettes
+	// water pixels of indexed terrain in every phase, appended as nodes are drawn. a pixel drawn again gets a new entry,
+	// the mask tells which pixels are still water, so stale and duplicate entries are skipped and dropped by CompactWater
+	struct WaterPixel
+	{
+		uint32_t mOffset;
+		uint16_t mPhases[WaterPhases];
+	};
+	std::vector<WaterPixel> mWater;
+	std::vector<uint8_t> mWaterMask;
+	uint32_t mWaterLive = 0;
+	void ClearWater();
+	void CompactWater();
+	void MoveWater(int32_t offsX, int32_t offsY);
+
+	// object palettes, one per distinct base palette. after lighting changes, new colors for terrain and objects are generated
+	// a few levels per frame and switched to at once
+	static const uint32_t PaletteLevelsPerFrame = 64;
 	std::vector<CompoundPalette*> mObjectPalettes;
+	bool mPalettesPending = false;
+	void UpdatePendingPalettes();
+	void CommitPalettes();
 
 	// dynamic lighting and terrain shading
 	std::vector<uint8_t> mTerrainShade; // absolute 0 - 255
+	float mSun[3];
 	std::vector<int8_t> mTerrainLight; // relative -128 - 127
 
 
-	// drawing queue
+	// retained display list of visible objects. order is (sort key, sprite hint, command index), radix sorted.
+	// rebuilt when visible objects change, objects that only changed look are patched in place
 	uint32_t mRenderID = 0;
-	struct DrawCallEntry
+	std::vector<MapDrawCommand> mDrawCommands;
+	std::vector<uint64_t> mDrawOrder;
+	std::vector<uint64_t> mDrawOrderTemp;
+	struct DisplayRange
 	{
-		int mWeight;
-		MapViewDrawCall mCallback;
+		uint32_t mBuild;
+		uint32_t mFirst;
+		uint32_t mCount;
 	};
-	std::forward_list<DrawCallEntry> mDrawQueue;
+	std::vector<DisplayRange> mDisplayRanges; // by object handle index
+	std::vector<MapObjectHandle> mDisplayDirty;
+	uint32_t mDisplayBuild = 1;
+	bool mDisplayRebuild = true;
+	void UpdateDisplayList();
+	void SortDrawCommands();
+	void ExecuteDrawCommands();
+
+	// shadows are accumulated into one coverage mask over the clip rect, so overlapping shadows don't darken twice.
+	// sprites drawn over a shadow clear the mask under their pixels, and the mask is applied to the screen once at the end of a bin
+	std::vector<uint8_t> mShadowMask;
+	void ResolveShadows(DrawingContext& ctx, const Rect& maskRect, const Rect& bounds);
+
+	// objects are drawn in horizontal bins of the clip rect, one worker job per bin. commands are listed by position in mDrawOrder
+	static const int32_t BinHeight = 64;
+	bool mBinnedDraw = true;
+	std::vector<std::vector<uint32_t>> mBins;
+	void DrawCommands(const Rect& clip, bool binned);
+	void DrawBin(uint32_t bin, const Rect& clip, const Rect& binRect);
+#ifdef ALLODS_BENCHMARKS
+	// draws the frame serially and in bins, and logs how many pixels differ
+	bool mVerifyBinnedDraw = false;
+	void VerifyBinnedDraw(const Rect& clip);
+#endif
 
 };
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "PaletteRegistry.h"
+#include "../draw/Simd.h"
+#include <algorithm>
+#include <cstring>
+
+const uint32_t PaletteTable::NumLevels;
+
+PaletteTable::PaletteTable(const Color* basePalette, uint64_t hash, Color tint, uint16_t brightness, uint16_t contrast)
+{
+	mHash = hash;
+	memcpy(mBasePalette, basePalette, sizeof(mBasePalette));
+	mTint = tint;
+	mBrightness = brightness;
+	mContrast = contrast;
+	mRefs = 0;
+
+	mLit.resize(256 * 4);
+	for (uint32_t j = 0; j < 256; j++)
+	{
+		int32_t channels[3] = { mBasePalette[j].components.b, mBasePalette[j].components.g, mBasePalette[j].components.r };
+		int32_t tints[3] = { tint.components.b, tint.components.g, tint.components.r };
+		for (int c = 0; c < 3; c++)
+		{
+			// #1: apply tint
+			int32_t v = channels[c] * tints[c] / 255;
+			// #2: apply contrast. can go below zero, which is black
+			v = std::max(0, ((v + 127) * contrast / 255) - 127);
+			// #3: apply brightness
+			v = v * brightness / 255;
+			mLit[j * 4 + c] = v;
+		}
+		mLit[j * 4 + 3] = 0;
+	}
+
+	mLevels.resize(256 * NumLevels);
+	for (uint32_t i = 0; i < NumLevels; i++)
+		SDL_AtomicSet(&mReady[i], 0);
+}
+
+bool PaletteTable::IsLevelReady(uint32_t level) const
+{
+	return SDL_AtomicGet(&mReady[level]) != 0;
+}
+
+const Color* PaletteTable::GetLevel(uint32_t level)
+{
+	if (level >= NumLevels)
+		return nullptr;
+	if (!IsLevelReady(level))
+	{
+		RLock lock(mMutex);
+		if (!IsLevelReady(level))
+		{
+			GenerateLevel(level);
+			SDL_AtomicSet(&mReady[level], 1);
+		}
+	}
+	return mLevels.data() + 256 * level;
+}
+
+bool PaletteTable::GenerateLike(const PaletteTable* other, uint32_t& count)
+{
+	for (uint32_t i = 0; i < NumLevels; i++)
+	{
+		if (IsLevelReady(i) || (other != nullptr && !other->IsLevelReady(i)))
+			continue;
+		if (!count)
+			return false;
+		GetLevel(i);
+		count--;
+	}
+	return true;
+}
+
+void PaletteTable::GenerateLevel(uint32_t level)
+{
+	// #4: apply brightness delta. dark levels are lit * i / 31, light levels are lit + lit * (i - 32) * 2 / 31.
+	// both are lit * scale / 31
+	int32_t scale;
+	if (level < 31)
+		scale = level;
+	else if (level > 32)
+		scale = 31 + (level - 32) * 2;
+	else scale = 31;
+
+	Color* out = mLevels.data() + 256 * level;
+	const int32_t* lit = mLit.data();
+	uint32_t j = 0;
+
+#ifdef ALLODS_SSE2
+	// lit * scale is exact in float, and correctly rounded division truncates to the same value as integer division.
+	// #5: saturating packs clamp to 0-255
+	__m128 scaleV = _mm_set1_ps(float(scale));
+	__m128 divisor = _mm_set1_ps(31.0f);
+	__m128i alpha = _mm_set1_epi32(0xFF000000);
+	for (; j < 256; j += 4)
+	{
+		__m128i c[4];
+		for (int k = 0; k < 4; k++)
+		{
+			__m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(lit + (j + k) * 4)));
+			c[k] = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(v, scaleV), divisor));
+		}
+		__m128i packed = _mm_packus_epi16(_mm_packs_epi32(c[0], c[1]), _mm_packs_epi32(c[2], c[3]));
+		_mm_storeu_si128((__m128i*)(out + j), _mm_or_si128(packed, alpha));
+	}
+#endif
+
+	for (; j < 256; j++)
+	{
+		// #5: clamp to 0-255
+		uint8_t b = std::min(255, lit[j * 4] * scale / 31);
+		uint8_t g = std::min(255, lit[j * 4 + 1] * scale / 31);
+		uint8_t r = std::min(255, lit[j * 4 + 2] * scale / 31);
+		out[j] = Color(r, g, b, 255);
+	}
+}
+
+PaletteRegistry* PaletteRegistry::GetInstance()
+{
+	// never destroyed, palettes can be released by views destroyed at exit
+	static PaletteRegistry* registry = new PaletteRegistry();
+	return registry;
+}
+
+uint64_t PaletteRegistry::HashPalette(const Color* basePalette)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		hash ^= basePalette[i].value & 0x00FFFFFF;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+PaletteTable* PaletteRegistry::Acquire(const Color* basePalette, Color tint, uint16_t brightness, uint16_t contrast)
+{
+	uint64_t hash = HashPalette(basePalette);
+
+	RLock lock(mMutex);
+	auto range = mTables.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		PaletteTable* table = it->second;
+		if (table->mTint == tint && table->mBrightness == brightness && table->mContrast == contrast &&
+			!memcmp(table->mBasePalette, basePalette, sizeof(table->mBasePalette)))
+		{
+			table->mRefs++;
+			return table;
+		}
+	}
+
+	PaletteTable* table = new PaletteTable(basePalette, hash, tint, brightness, contrast);
+	table->mRefs = 1;
+	mTables.emplace(hash, table);
+	return table;
+}
+
+void PaletteRegistry::Release(PaletteTable* table)
+{
+	if (table == nullptr)
+		return;
+
+	RLock lock(mMutex);
+	if (--table->mRefs)
+		return;
+	auto range = mTables.equal_range(table->mHash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		if (it->second == table)
+		{
+			mTables.erase(it);
+			break;
+		}
+	}
+	delete table;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include "../screen/Color.h"
+#include "../Thread.h"
+
+// 65 versions of a base palette for light/shadow with the specified tint
+// 0-30: dark
+// 31-32: normal
+// 33-64: light
+// levels are generated on first access, so levels that are never drawn cost nothing
+class PaletteTable
+{
+public:
+	static const uint32_t NumLevels = 65;
+
+	// thread safe, generates the level if it's not there yet
+	const Color* GetLevel(uint32_t level);
+	bool IsLevelReady(uint32_t level) const;
+	// generates levels that are ready in other table (or every level if other is null), at most count of them.
+	// count is decreased by levels generated. returns true if nothing is left to generate
+	bool GenerateLike(const PaletteTable* other, uint32_t& count);
+
+private:
+	PaletteTable(const Color* basePalette, uint64_t hash, Color tint, uint16_t brightness, uint16_t contrast);
+	void GenerateLevel(uint32_t level);
+
+	uint64_t mHash;
+	Color mBasePalette[256];
+	Color mTint;
+	uint16_t mBrightness;
+	uint16_t mContrast;
+	uint32_t mRefs;
+
+	// base colors with tint, contrast and brightness applied, 4 channels each (b, g, r, a). levels only scale these
+	std::vector<int32_t> mLit;
+	std::vector<Color> mLevels;
+	mutable SDL_atomic_t mReady[NumLevels];
+	Mutex mMutex;
+
+	friend class PaletteRegistry;
+};
+
+// palette tables shared by all palettes with the same base colors and lighting, in every view
+class PaletteRegistry
+{
+public:
+	static PaletteRegistry* GetInstance();
+	static uint64_t HashPalette(const Color* basePalette);
+
+	// returns table with one more reference
+	PaletteTable* Acquire(const Color* basePalette, Color tint, uint16_t brightness, uint16_t contrast);
+	void Release(PaletteTable* table);
+
+private:
+	Mutex mMutex;
+	std::unordered_multimap<uint64_t, PaletteTable*> mTables; // by base palette hash
+};
@@ -0,0 +1,102 @@
+#include "DamageTracker.h"
+#include <algorithm>
+
+const int32_t DamageTracker::TileShift;
+const uint32_t DamageTracker::MaxRects;
+
+void DamageTracker::SetSize(int32_t w, int32_t h)
+{
+	mWidth = w;
+	mHeight = h;
+	mTilesW = (w + (1 << TileShift) - 1) >> TileShift;
+	mTilesH = (h + (1 << TileShift) - 1) >> TileShift;
+	mTiles.assign(mTilesW * mTilesH, 1);
+	mIsEmpty = false;
+}
+
+void DamageTracker::Add(const Rect& rect)
+{
+	Rect clipped = rect.GetIntersection(Rect::FromXYWH(0, 0, mWidth, mHeight));
+	if (clipped.w <= 0 || clipped.h <= 0)
+		return;
+
+	int32_t left = clipped.GetLeft() >> TileShift;
+	int32_t right = (clipped.GetRight() - 1) >> TileShift;
+	int32_t top = clipped.GetTop() >> TileShift;
+	int32_t bottom = (clipped.GetBottom() - 1) >> TileShift;
+	for (int32_t ty = top; ty <= bottom; ty++)
+		std::fill(mTiles.begin() + ty * mTilesW + left, mTiles.begin() + ty * mTilesW + right + 1, 1);
+	mIsEmpty = false;
+}
+
+void DamageTracker::AddAll()
+{
+	std::fill(mTiles.begin(), mTiles.end(), 1);
+	mIsEmpty = false;
+}
+
+bool DamageTracker::IsEmpty()
+{
+	return mIsEmpty;
+}
+
+void DamageTracker::Collect(std::vector<Rect>& rects)
+{
+	rects.clear();
+	if (mIsEmpty)
+		return;
+
+	// rects that may still grow down, in tiles. x is tile column, w is run length
+	std::vector<Rect> open;
+	std::vector<Rect> next;
+	for (int32_t ty = 0; ty <= mTilesH; ty++)
+	{
+		next.clear();
+		uint8_t* row = mTiles.data() + ty * mTilesW;
+		int32_t tx = 0;
+		while (ty < mTilesH && tx < mTilesW)
+		{
+			if (!row[tx])
+			{
+				tx++;
+				continue;
+			}
+			int32_t start = tx;
+			while (tx < mTilesW && row[tx])
+				row[tx++] = 0;
+
+			Rect run = Rect::FromXYWH(start, ty, tx - start, 1);
+			auto it = std::find_if(open.begin(), open.end(), [&](const Rect& r) { return r.x == run.x && r.w == run.w; });
+			if (it != open.end())
+			{
+				run = *it;
+				run.h++;
+				open.erase(it);
+			}
+			next.push_back(run);
+		}
+
+		// runs that didn't continue are done
+		for (auto& r : open)
+		{
+			rects.push_back(Rect::FromLTRB(r.GetLeft() << TileShift, r.GetTop() << TileShift,
+				std::min(r.GetRight() << TileShift, mWidth), std::min(r.GetBottom() << TileShift, mHeight)));
+		}
+		open.swap(next);
+	}
+	mIsEmpty = true;
+
+	if (rects.size() > MaxRects)
+	{
+		int32_t left = mWidth, top = mHeight, right = 0, bottom = 0;
+		for (auto& r : rects)
+		{
+			left = std::min(left, r.GetLeft());
+			top = std::min(top, r.GetTop());
+			right = std::max(right, r.GetRight());
+			bottom = std::max(bottom, r.GetBottom());
+		}
+		rects.clear();
+		rects.push_back(Rect::FromLTRB(left, top, right, bottom));
+	}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "Rect.h"
+
+// changed screen areas of the current frame, kept as a grid of 32x32 tiles.
+// marking is cheap for any number of rects, collecting turns the grid into a few rects for presenting
+class DamageTracker
+{
+public:
+
+	static const int32_t TileShift = 5;
+	// more rects than this are presented as their bounding box
+	static const uint32_t MaxRects = 64;
+
+	void SetSize(int32_t w, int32_t h);
+	void Add(const Rect& rect);
+	void AddAll();
+	bool IsEmpty();
+
+	// runs of marked tiles in a row, merged with equal runs in the rows below. clears the grid
+	void Collect(std::vector<Rect>& rects);
+
+private:
+
+	int32_t mWidth = 0;
+	int32_t mHeight = 0;
+	int32_t mTilesW = 0;
+	int32_t mTilesH = 0;
+	std::vector<uint8_t> mTiles;
+	bool mIsEmpty = true;
+
+};
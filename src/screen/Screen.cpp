@@ -1,6 +1,8 @@
 #include "Screen.h"
 #include "../logging.h"
 #include "../Application.h"
+#include "../draw/DrawingContext.h"
+#include <algorithm>
 
 Screen::Screen(int w, int h)
 {
@@ -39,14 +41,31 @@ Screen::Screen(int w, int h)
 	}
 
 	mViewport = Rect::FromXYWH(0, 0, w, h);
+	mDamage.SetSize(w, h);
+	for (auto& buffer : mBuffers)
+		buffer.assign(w * h, Color(0, 0, 0, 255));
+	// window surface starts with whatever it has
+	mDamage.AddAll();
 
 	mFPS = 0;
 	mFPSTimer = 0;
 
+	mPresentThread = new PresentThread(this);
+	mPresentThread->Start();
+
 }
 
 Screen::~Screen()
 {
+	if (mPresentThread != nullptr)
+	{
+		WaitPresent();
+		mPresentExiting = true;
+		mPresentStart.Post();
+		mPresentThread->Wait();
+		delete mPresentThread;
+		mPresentThread = nullptr;
+	}
 	if (mWindow != nullptr)
 		SDL_DestroyWindow(mWindow);
 	// surface is controlled by window
@@ -63,8 +82,7 @@ Color* Screen::GetBuffer()
 {
 	if (mWindow == nullptr || mSurface == nullptr)
 		return nullptr;
-	// can we be sure that this is always consistent?
-	return (Color*)mSurface->pixels;
+	return mBuffers[mDrawBuffer].data();
 }
 
 Rect Screen::GetViewport()
@@ -81,20 +99,217 @@ void Screen::Apply()
 	mFPSLast++;
 	if (Application::GetTicks() - mFPSTimer > 1000)
 	{
+		mPresentLatency = mPresentCount ? mLatencySum / mPresentCount : 0;
+		mPresentWait = mPresentCount ? mWaitSum / mPresentCount : 0;
+		if (mDamageOverlay)
+		{
+			uint64_t percent = mPresentedPixels * 100 / (uint64_t(mViewport.w) * mViewport.h * std::max(mFPSLast, uint64_t(1)));
+			SDL_SetWindowTitle(mWindow, Format("Allods (%d FPS, %d%% presented, latency %d us, waited %d us)", mFPSLast, percent, mPresentLatency, mPresentWait).c_str());
+		}
+		else SDL_SetWindowTitle(mWindow, Format("Allods (%d FPS)", mFPSLast).c_str());
 		mFPS = mFPSLast;
 		mFPSLast = 0;
+		mPresentedPixels = 0;
+		mLatencySum = mWaitSum = mPresentCount = 0;
 		mFPSTimer = Application::GetTicks();
-		SDL_SetWindowTitle(mWindow, Format("Allods (%d FPS)", mFPS).c_str());
 	}
-	SDL_UpdateWindowSurface(mWindow);
+
+	mDamage.Collect(mDamageRects);
+	if (mDamageRects.empty())
+		return;
+
+	uint64_t pixels = 0;
+	for (auto& r : mDamageRects)
+		pixels += r.w * r.h;
+	mPresentedPixels += pixels;
+
+	if (mDamageOverlay)
+	{
+		// outlines stay in the framebuffer, so they are damaged again to be erased next frame
+		DrawingContext ctx(this);
+		for (auto& r : mDamageRects)
+		{
+			Color c(255, 0, 255, 255);
+			ctx.DrawLine(Point(r.GetLeft(), r.GetTop()), Point(r.GetRight() - 1, r.GetTop()), c);
+			ctx.DrawLine(Point(r.GetLeft(), r.GetBottom() - 1), Point(r.GetRight() - 1, r.GetBottom() - 1), c);
+			ctx.DrawLine(Point(r.GetLeft(), r.GetTop()), Point(r.GetLeft(), r.GetBottom() - 1), c);
+			ctx.DrawLine(Point(r.GetRight() - 1, r.GetTop()), Point(r.GetRight() - 1, r.GetBottom() - 1), c);
+			mDamage.Add(r);
+		}
+	}
+
+	// the other buffer is still being presented, and the job is about to be reused
+	WaitPresent();
+
+	// mostly changed frame is cheaper to present at once
+	mJob.mBuffer = mDrawBuffer;
+	mJob.mRects = mDamageRects;
+	mJob.mFull = (pixels * 4 >= uint64_t(mViewport.w) * mViewport.h * 3);
+	mJob.mOverlayPixels = mOverlayPixels;
+	mJob.mOverlayRect = mOverlayRect;
+	mJob.mSubmitTime = Application::GetMicroTicks();
+	mPresentPending = true;
+	mPresentStart.Post();
+
+	// next frame is drawn into the other buffer. it is one frame behind, exactly by what was damaged in this one
+	const Color* done = mBuffers[mDrawBuffer].data();
+	mDrawBuffer ^= 1;
+	Color* next = mBuffers[mDrawBuffer].data();
+	for (auto& r : mDamageRects)
+	{
+		Rect clip = r.GetIntersection(mViewport);
+		for (int32_t y = clip.GetTop(); y < clip.GetBottom(); y++)
+			memcpy(next + y * mViewport.w + clip.x, done + y * mViewport.w + clip.x, sizeof(Color) * clip.w);
+	}
+}
+
+void Screen::WaitPresent()
+{
+	if (!mPresentPending)
+		return;
+	uint64_t waitStart = Application::GetMicroTicks();
+	mPresentDone.Wait();
+	mPresentPending = false;
+	mWaitSum += Application::GetMicroTicks() - waitStart;
+	mLatencySum += mJob.mDoneTime - mJob.mSubmitTime;
+	mPresentCount++;
+}
+
+void Screen::RunPresent()
+{
+	while (true)
+	{
+		mPresentStart.Wait();
+		if (mPresentExiting)
+			break;
+		Present(mJob);
+		mPresentDone.Post();
+	}
+}
+
+void Screen::Present(PresentJob& job)
+{
+	// window surface holds the last presented frame with overlay. only damaged areas are copied over it
+	Color* surface = (Color*)mSurface->pixels;
+	const Color* buffer = mBuffers[job.mBuffer].data();
+	for (auto& r : job.mRects)
+	{
+		Rect clip = r.GetIntersection(mViewport);
+		for (int32_t y = clip.GetTop(); y < clip.GetBottom(); y++)
+			memcpy(surface + y * mViewport.w + clip.x, buffer + y * mViewport.w + clip.x, sizeof(Color) * clip.w);
+		CompositeOverlay(job, clip);
+	}
+
+	if (job.mFull)
+		SDL_UpdateWindowSurface(mWindow);
+	else
+	{
+		mPresentRects.assign(job.mRects.begin(), job.mRects.end());
+		SDL_UpdateWindowSurfaceRects(mWindow, mPresentRects.data(), mPresentRects.size());
+	}
+	job.mDoneTime = Application::GetMicroTicks();
+}
+
+void Screen::SetOverlay(const Color* pixels, int32_t w, int32_t h, int32_t x, int32_t y)
+{
+	Rect rect = Rect::FromXYWH(x, y, w, h);
+	if (pixels == mOverlayPixels && rect == mOverlayRect)
+		return;
+	// old place shows the frame again, new place shows the overlay
+	if (mOverlayPixels != nullptr)
+		mDamage.Add(mOverlayRect);
+	mDamage.Add(rect);
+	mOverlayPixels = pixels;
+	mOverlayRect = rect;
+}
+
+void Screen::ClearOverlay()
+{
+	if (mOverlayPixels == nullptr)
+		return;
+	mDamage.Add(mOverlayRect);
+	mOverlayPixels = nullptr;
+}
+
+void Screen::CompositeOverlay(const PresentJob& job, const Rect& rect)
+{
+	if (job.mOverlayPixels == nullptr)
+		return;
+	Rect clip = job.mOverlayRect.GetIntersection(rect);
+	if (clip.w <= 0 || clip.h <= 0)
+		return;
+
+	// blended from the frame, not from the surface, so pixels presented again don't get the overlay twice
+	Color* surface = (Color*)mSurface->pixels;
+	const Color* buffer = mBuffers[job.mBuffer].data();
+	for (int32_t y = clip.GetTop(); y < clip.GetBottom(); y++)
+	{
+		Color* line = surface + y * mViewport.w + clip.x;
+		const Color* frame = buffer + y * mViewport.w + clip.x;
+		const Color* overlay = job.mOverlayPixels + (y - job.mOverlayRect.y) * job.mOverlayRect.w + (clip.x - job.mOverlayRect.x);
+		for (int32_t x = 0; x < clip.w; x++)
+		{
+			Color o = overlay[x];
+			uint32_t inverseAlpha = o.components.a;
+			if (inverseAlpha == 15) // fully transparent
+				continue;
+			// c * inverseAlpha / 15 without dividing, exact for 0 - 255 * 15
+			uint32_t mul = inverseAlpha * 4370;
+			Color c = frame[x];
+			c.components.r = o.components.r + ((c.components.r * mul) >> 16);
+			c.components.g = o.components.g + ((c.components.g * mul) >> 16);
+			c.components.b = o.components.b + ((c.components.b * mul) >> 16);
+			c.components.a = 255;
+			line[x] = c;
+		}
+	}
+}
+
+void Screen::AddDamage(const Rect& rect)
+{
+	mDamage.Add(rect);
+}
+
+void Screen::AddDamageAll()
+{
+	mDamage.AddAll();
+}
+
+void Screen::SetDamageOverlay(bool overlay)
+{
+	if (mDamageOverlay == overlay)
+		return;
+	mDamageOverlay = overlay;
+	// old outlines have to be erased
+	mDamage.AddAll();
+}
+
+bool Screen::IsDamageOverlay()
+{
+	return mDamageOverlay;
 }
 
 bool Screen::PollEvent(SDL_Event& ev)
 {
-	return SDL_PollEvent(&ev);
+	if (!SDL_PollEvent(&ev))
+		return false;
+	// window contents may be lost
+	if (ev.type == SDL_WINDOWEVENT && (ev.window.event == SDL_WINDOWEVENT_EXPOSED || ev.window.event == SDL_WINDOWEVENT_RESTORED))
+		mDamage.AddAll();
+	return true;
 }
 
 uint64_t Screen::GetFPS()
 {
 	return mFPS;
+}
+
+uint64_t Screen::GetPresentLatency()
+{
+	return mPresentLatency;
+}
+
+uint64_t Screen::GetPresentWait()
+{
+	return mPresentWait;
 }
\ No newline at end of file
@@ -2,8 +2,11 @@
 
 #include <cstdint>
 #include <SDL.h>
+#include <vector>
 #include "Rect.h"
 #include "Color.h"
+#include "DamageTracker.h"
+#include "../Thread.h"
 
 class Screen
 {
@@ -15,13 +18,30 @@ public:
 	operator bool() { return IsValid(); }
 	bool IsValid();
 
+	// frames are drawn into one of two buffers while the other one is presented on the present thread.
+	// buffer changes after every Apply that presented something, don't keep it across frames
 	Color* GetBuffer();
 	Rect GetViewport();
+	// presents only areas damaged since the last Apply. everything that draws to the screen has to report what it changed.
+	// returns as soon as the frame is handed to the present thread, waiting only for the frame before it
 	void Apply();
+	void AddDamage(const Rect& rect);
+	void AddDamageAll();
+	// outlines presented rects on screen, and shows presented share of the screen in window title
+	void SetDamageOverlay(bool overlay);
+	bool IsDamageOverlay();
+	// layer composited over the frame only while presenting, used for cursor. nothing is drawn into the frame permanently.
+	// pixels are premultiplied, alpha byte holds 15 - alpha (16 levels). pixels must stay valid until the frame after next
+	void SetOverlay(const Color* pixels, int32_t w, int32_t h, int32_t x, int32_t y);
+	void ClearOverlay();
 
 	bool PollEvent(SDL_Event& ev);
 
 	uint64_t GetFPS();
+	// averages over the last second, in microseconds: from Apply to the frame being on screen, and how long Apply waited
+	// for the previous frame
+	uint64_t GetPresentLatency();
+	uint64_t GetPresentWait();
 
 private:
 	SDL_Window* mWindow;
@@ -29,6 +49,69 @@ private:
 	Rect mViewport;
 	SDL_DisplayMode mDisplayMode;
 
+	// frame buffers
+	std::vector<Color> mBuffers[2];
+	uint32_t mDrawBuffer = 0;
+
+	// damage
+	DamageTracker mDamage;
+	std::vector<Rect> mDamageRects;
+	bool mDamageOverlay = false;
+	uint64_t mPresentedPixels = 0;
+
+	// overlay
+	const Color* mOverlayPixels = nullptr;
+	Rect mOverlayRect;
+
+	// present thread. one frame is in flight at most, the job is only touched by the main thread while none is
+	struct PresentJob
+	{
+		uint32_t mBuffer;
+		std::vector<Rect> mRects;
+		bool mFull;
+		const Color* mOverlayPixels;
+		Rect mOverlayRect;
+		uint64_t mSubmitTime;
+		uint64_t mDoneTime;
+	};
+
+	class PresentThread : public Thread
+	{
+		Screen* mScreen;
+
+	public:
+		PresentThread(Screen* screen) : Thread("Present")
+		{
+			mScreen = screen;
+		}
+
+		virtual int Run()
+		{
+			mScreen->RunPresent();
+			return 0;
+		}
+	};
+
+	PresentJob mJob;
+	PresentThread* mPresentThread = nullptr;
+	Semaphore mPresentStart;
+	Semaphore mPresentDone;
+	bool mPresentPending = false;
+	bool mPresentExiting = false;
+	std::vector<SDL_Rect> mPresentRects;
+	void RunPresent();
+	void Present(PresentJob& job);
+	void CompositeOverlay(const PresentJob& job, const Rect& rect);
+	// fence: returns when the last frame handed to the present thread is on screen
+	void WaitPresent();
+
+	// present stats, summed over a second
+	uint64_t mLatencySum = 0;
+	uint64_t mWaitSum = 0;
+	uint64_t mPresentCount = 0;
+	uint64_t mPresentLatency = 0;
+	uint64_t mPresentWait = 0;
+
 	//
 	uint64_t mFPSTimer;
 	uint64_t mFPSLast;
@@ -3,6 +3,7 @@
 #include "../Application.h"
 #include "../logging.h"
 #include "../data/ImageTruecolor.h"
+#include <algorithm>
 
 Mouse::Mouse()
 {
@@ -10,68 +11,85 @@ Mouse::Mouse()
 	mInternalCursors[Default].Set(new Sprite16A("graphics/cursors/default/sprites.16a"), 4, 4, -1, false);
 	mInternalCursors[Wait].Set(new Sprite16A("graphics/cursors/wait/sprites.16a"), 16, 16, 50, false);
 	mCurrentCursor = nullptr;
-	mSavedBuffer = new ImageTruecolor(0, 0);
 }
 
 Mouse::~Mouse()
 {
-	delete mSavedBuffer;
 }
 
 void Mouse::PreApply()
 {
 
+	Screen* screen = Application::GetInstance()->GetScreen();
 	if (mCurrentCursor == nullptr || mCurrentCursor->mSprite == nullptr)
+	{
+		screen->ClearOverlay();
 		return;
+	}
 
 	// tick mouse animation
 	if (mLastTime == 0)
-		mLastTime = Application::GetTicks();
+		mLastTime = Application::GetMicroTicks();
 	
 	if (mCurrentCursor->mAnimDelay > 0)
 	{
-		int64_t leftTime = Application::GetTicks() - mLastTime;
-		while (leftTime > mCurrentCursor->mAnimDelay)
+		int64_t animDelay = int64_t(mCurrentCursor->mAnimDelay) * 1000;
+		int64_t leftTime = Application::GetMicroTicks() - mLastTime;
+		while (leftTime > animDelay)
 		{
 			mCurrentCursor->mAnimFrame = (mCurrentCursor->mAnimFrame + 1) % mCurrentCursor->mSprite->GetSize();
-			leftTime -= mCurrentCursor->mAnimDelay;
-			mLastTime += mCurrentCursor->mAnimDelay;
+			leftTime -= animDelay;
+			mLastTime += animDelay;
 		}
 		
 	}
 
-	Screen* screen = Application::GetInstance()->GetScreen();
-	Rect viewport = screen->GetViewport();
-
-	Rect curMouseRect = Rect::FromXYWH(
-		mPosition.x - mCurrentCursor->mOffsetX,
-		mPosition.y - mCurrentCursor->mOffsetY,
-		mCurrentCursor->mSprite->GetWidth(mCurrentCursor->mAnimFrame),
-		mCurrentCursor->mSprite->GetHeight(mCurrentCursor->mAnimFrame)
-	).GetIntersection(viewport);
+	// all frames are expanded when the cursor is shown first
+	if (mCurrentCursor->mFrames.empty())
+	{
+		mCurrentCursor->mFrames.resize(mCurrentCursor->mSprite->GetSize());
+		for (uint32_t i = 0; i < mCurrentCursor->mFrames.size(); i++)
+			ExpandFrame(mCurrentCursor->mSprite, i, mCurrentCursor->mFrames[i]);
+	}
 
-	mSavedBuffer->FromScreen(curMouseRect);
-	mSavedRect = curMouseRect;
+	if (mCurrentCursor->mAnimFrame >= mCurrentCursor->mFrames.size())
+	{
+		screen->ClearOverlay();
+		return;
+	}
 
-	// render mouse
-	DrawingContext ctx(screen);
-	mCurrentCursor->mSprite->Draw(ctx,
+	const CursorFrame& frame = mCurrentCursor->mFrames[mCurrentCursor->mAnimFrame];
+	screen->SetOverlay(frame.mPixels.data(), frame.mWidth, frame.mHeight,
 		mPosition.x - mCurrentCursor->mOffsetX,
-		mPosition.y - mCurrentCursor->mOffsetY,
-		mCurrentCursor->mAnimFrame,
-		mCurrentCursor->mSprite->GetPalette());
+		mPosition.y - mCurrentCursor->mOffsetY);
 
 }
 
-void Mouse::PostApply()
+void Mouse::ExpandFrame(Sprite* sprite, uint32_t index, CursorFrame& out)
 {
 
-	if (mCurrentCursor == nullptr || mCurrentCursor->mSprite == nullptr)
-		return;
-
-	Screen* screen = Application::GetInstance()->GetScreen();
-	DrawingContext toScreen(screen);
-	mSavedBuffer->Blit(toScreen, mSavedRect.x, mSavedRect.y);
+	// frame is drawn over black and over white. black gives color * alpha, difference gives 255 * (15 - alpha) / 15.
+	// this works for any sprite format, and matches what AlphaBlend16 does when drawing to screen
+	out.mWidth = sprite->GetWidth(index);
+	out.mHeight = sprite->GetHeight(index);
+	out.mPixels.resize(out.mWidth * out.mHeight);
+
+	ImageTruecolor overBlack(out.mWidth, out.mHeight);
+	ImageTruecolor overWhite(out.mWidth, out.mHeight);
+	std::fill(overBlack.GetBuffer(), overBlack.GetBuffer() + out.mPixels.size(), Color(0, 0, 0, 255));
+	std::fill(overWhite.GetBuffer(), overWhite.GetBuffer() + out.mPixels.size(), Color(255, 255, 255, 255));
+	DrawingContext blackCtx(&overBlack);
+	DrawingContext whiteCtx(&overWhite);
+	sprite->Draw(blackCtx, 0, 0, index, sprite->GetPalette());
+	sprite->Draw(whiteCtx, 0, 0, index, sprite->GetPalette());
+
+	for (size_t i = 0; i < out.mPixels.size(); i++)
+	{
+		Color c = overBlack.GetBuffer()[i];
+		uint8_t inverseAlpha = (overWhite.GetBuffer()[i].components.g - c.components.g) / 17;
+		c.components.a = inverseAlpha;
+		out.mPixels[i] = c;
+	}
 
 }
 
@@ -13,10 +13,8 @@ public:
 	Mouse();
 	~Mouse();
 
-	// draw mouse
+	// animate mouse and pass current frame to screen overlay
 	void PreApply();
-	// undraw mouse
-	void PostApply();
 	// set pos
 	void SetPosition(const Point& p);
 
@@ -45,6 +43,14 @@ public:
 
 
 private:
+	// sprite frame expanded once to premultiplied colors, see Screen::SetOverlay
+	struct CursorFrame
+	{
+		std::vector<Color> mPixels;
+		int32_t mWidth;
+		int32_t mHeight;
+	};
+
 	//
 	struct MouseCursorInfo
 	{
@@ -54,6 +60,7 @@ private:
 		int32_t mAnimDelay;
 		uint32_t mAnimFrame;
 		bool mTransient;
+		std::vector<CursorFrame> mFrames;
 
 		MouseCursorInfo()
 		{
@@ -77,6 +84,7 @@ private:
 			mAnimDelay = animDelay;
 			mAnimFrame = 0;
 			mTransient = transient;
+			mFrames.clear();
 		}
 
 		~MouseCursorInfo()
@@ -92,9 +100,7 @@ private:
 
 	Point mPosition;
 
-	// stores saved screen rect
-	ImageTruecolor* mSavedBuffer;
-	Rect mSavedRect;
+	static void ExpandFrame(Sprite* sprite, uint32_t index, CursorFrame& out);
 
 	uint64_t mLastTime = 0;
 };
\ No newline at end of file